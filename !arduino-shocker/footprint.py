@@ -0,0 +1,39 @@
+# `pio run -t footprint` prints the size of every section of the firmware and fails when the flash or the static RAM
+# passes custom_flash_budget or custom_ram_budget in platformio.ini. Static RAM is .data and .bss, what is left of the
+# 2 KB belongs to the stack. How much of that the stack really used shows on the board: the T command prints the
+# least free stack since boot (see Stack headroom in src/main.cpp).
+Import("env")
+
+import subprocess
+
+
+def footprint(target, source, env):
+    output = subprocess.check_output([env.subst("$SIZETOOL"), "-A", str(source[0])], universal_newlines=True)
+    print(output)
+
+    sections = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0].startswith(".") and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+
+    flash = sections.get(".text", 0) + sections.get(".data", 0) # .data is copied from flash at boot
+    ram = sections.get(".data", 0) + sections.get(".bss", 0) + sections.get(".noinit", 0)
+    flash_budget = int(env.GetProjectOption("custom_flash_budget"))
+    ram_budget = int(env.GetProjectOption("custom_ram_budget"))
+
+    print("Flash:      %5d of %5d bytes budgeted" % (flash, flash_budget))
+    print("Static RAM: %5d of %5d bytes budgeted" % (ram, ram_budget))
+    if flash > flash_budget or ram > ram_budget:
+        print("Over the footprint budget")
+        return 1
+    return 0
+
+
+env.AddCustomTarget(
+    name="footprint",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=footprint,
+    title="Footprint",
+    description="Print the section sizes and check them against the budgets",
+)
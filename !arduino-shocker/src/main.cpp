@@ -1,262 +1,214 @@
 #include <Arduino.h>
+#include <EEPROM.h>
+#include <avr/sleep.h>
+#include <ShockerCore.h>
 
 // Config
-    #define POWER_ADJUST_ON_TIME_MS 40  // The time the button is held down when changing the power.
-    #define POWER_ADJUST_OFF_TIME_MS 40 // The gap between presses of the button.
-
+    #define CALIBRATION_EEPROM_ADDRESS 0
+    #define TIMING_EEPROM_ADDRESS 16
+    #define IDLE_SLEEP 1     // Stop the CPU between interrupts while there is nothing to do, see sleepUntilInterrupt()
+    #define STACK_PAINT 0xC5 // Fills the free RAM at boot, see Stack headroom
+
+
+// Board
+// Two ranges selected by their own pins, homed by walking the counter to one of their ends.
+    struct NanoBoard {
+        static constexpr const char *NAME = "nano";
+
+        // Pins
+            static constexpr ShockerPins CHANNELS[] = {
+                // Shocker, increase power button, decrease power button, built-in LED
+                { 8, 9, 10, 13 },
+            };
+            static constexpr uint8_t PIN_RANGE_LOW = 11;      // Pin number for the low range selector
+            static constexpr uint8_t PIN_RANGE_HIGH = 12;     // Pin number for the high range selector
+
+        // Timing
+            static constexpr unsigned long POWER_ADJUST_ON_TIME_MS = 40;    // The time the button is held down when changing the power.
+            static constexpr unsigned long POWER_ADJUST_OFF_TIME_MS = 40;   // The gap between presses of the button.
+            static constexpr unsigned long POWER_COMMAND_TIMEOUT_MS = 1000; // Maximum time to wait for the rest of a P<n>! or D<ms>! command.
+
+        // Ranges
+        // Low range goes from 0 to 50, high range goes from 51 to 99
+            static constexpr bool DUAL_RANGE = true;
+            static constexpr int LOW_RANGE_TOP = 50;
+            static constexpr unsigned long RANGE_RELEASE_TIME_MS = 5;  // The gap between releasing one range selector and engaging the other.
+            static constexpr unsigned long RANGE_SETTLE_TIME_MS = 100; // The time the range selector needs before the power buttons are used.
+
+        static constexpr HomingStrategy HOMING = HomingStrategy::WALK;
+        static constexpr bool SPLIT_TASKS = false;
+
+        // Patterns, RAM only
+            static constexpr uint8_t PATTERN_SLOTS = 2;
+            static constexpr uint8_t PATTERN_MAX_SIZE = 32; // Bytes per program
+            static constexpr bool PATTERN_STORAGE = false;
+
+        static constexpr bool UART_WAKE = false; // Idle sleep keeps the UART running
+        static constexpr int SERIAL_RX_CAPACITY = SERIAL_RX_BUFFER_SIZE - 1; // Set in platformio.ini, the AVR core keeps one byte of its ring free
+
+        // Metrics
+            static constexpr uint32_t METRICS_CLOCK_PER_US = 1;
+            static uint32_t metricsClock(){
+                return micros(); // 4 us steps, there is no cycle counter
+            }
 
-// Pins
-    #define PIN_LED 13            // Pin number for the built-in LED
-    #define PIN_SHOCKER 8         // Pin number for the shocker
-    #define PIN_INCREASE_POWER 9  // Pin number for the increase power button
-    #define PIN_DECREASE_POWER 10 // Pin number for the decrease power button
-    #define PIN_RANGE_LOW 11       // Pin number for the low range selector
-    #define PIN_RANGE_HIGH 12      // Pin number for the high range selector
+        static void startPulseTimer(uint8_t channel, uint16_t length_ms);
+        static void stopPulseTimer(uint8_t channel);
+        static void startPressTimer(uint8_t channel, uint8_t first_ms);
+        static bool readStorage(uint8_t channel, void *data, size_t size);
+        static void writeStorage(uint8_t channel, const void *data, size_t size);
+        static bool readTiming(uint8_t channel, void *data, size_t size);
+        static void writeTiming(uint8_t channel, const void *data, size_t size);
+        static bool handleCommand(char command);
+    };
 
 
 // State
-    enum class ShockerState {
-        IDLE,
-        BUSY,
-        SHOCKING,
-    };
-    ShockerState currentState = ShockerState::IDLE;
+    ShockerCore<NanoBoard> shocker;
+
+    // Timed pulse
+    // Timer1 ticks every 4 us and interrupts once per millisecond until the pulse is over.
+        volatile uint16_t pulseRemainingMs = 0; // Counted down by the interrupt
 
-    int powerLevelLow = 50; // Power level for the shocker (0-50)
-    int powerLevelHigh = 99; // Power level for the shocker (51-99)
-    bool isHighRange = false; // Current range state
+    // Press train
+    // Timer2 ticks every 8 us and interrupts once per millisecond while the channel has presses to run.
+        volatile uint8_t pressRemainingMs = 0; // Until the next pressTimerEdge(), counted down by the interrupt
 
 
 // Functions
-    // Reporting state
-        void reportStateIdle(){
-            currentState = ShockerState::IDLE;
-            Serial.print("B\n");
+    // Pulse timer
+        ISR(TIMER1_COMPA_vect){
+            if(--pulseRemainingMs == 0){
+                digitalWrite(NanoBoard::CHANNELS[0].shocker, LOW);
+                TCCR1B = 0; // Stop the timer
+                shocker.channels[0].pulseEnded = true;
+            }
         }
-        void reportStateBusy(){
-            currentState = ShockerState::BUSY;
-            Serial.print("C\n");
+        void NanoBoard::startPulseTimer(uint8_t /*channel*/, uint16_t length_ms){
+            noInterrupts();
+            TCCR1B = 0;
+            TCCR1A = 0;
+            TCNT1 = 0;
+            OCR1A = 249; // 250 ticks of 4 us
+            TIFR1 = _BV(OCF1A); // Clear a compare match left over from an earlier pulse
+            TIMSK1 = _BV(OCIE1A);
+            pulseRemainingMs = length_ms;
+            TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10); // CTC mode, 16 MHz / 64
+            interrupts();
         }
-        void reportStateShocking(){
-            currentState = ShockerState::SHOCKING;
-            Serial.print("A\n");
+        void NanoBoard::stopPulseTimer(uint8_t /*channel*/){
+            TCCR1B = 0;
+            TIMSK1 = 0;
         }
-        void reportPowerLevel(){
-            Serial.print("P");
 
-            if(isHighRange){
-                Serial.print(powerLevelHigh);
-            } else {
-                Serial.print(powerLevelLow);
+    // Press timer
+        ISR(TIMER2_COMPA_vect){
+            if(--pressRemainingMs == 0){
+                pressRemainingMs = shocker.channels[0].pressTimerEdge();
+                if(pressRemainingMs == 0){
+                    TCCR2B = 0; // Stop the timer
+                }
             }
-
-            Serial.print("!\n");
-        }
-
-    // Pressing the buttons
-        void pressShockStart(){
-            digitalWrite(PIN_LED, HIGH);
-            digitalWrite(PIN_SHOCKER, HIGH);
-            reportStateShocking();
         }
-        void pressShockStop(){
-            digitalWrite(PIN_LED, LOW);
-            digitalWrite(PIN_SHOCKER, LOW);
-            reportStateIdle();
+        void NanoBoard::startPressTimer(uint8_t /*channel*/, uint8_t first_ms){
+            noInterrupts();
+            TCCR2B = 0;
+            TCCR2A = _BV(WGM21); // CTC mode
+            TCNT2 = 0;
+            OCR2A = 124; // 125 ticks of 8 us
+            TIFR2 = _BV(OCF2A); // Clear a compare match left over from an earlier train
+            TIMSK2 = _BV(OCIE2A);
+            pressRemainingMs = first_ms;
+            TCCR2B = _BV(CS22) | _BV(CS20); // 16 MHz / 128
+            interrupts();
         }
-        void pressPowerInc(){
-            digitalWrite(PIN_INCREASE_POWER, HIGH);
-            delay(POWER_ADJUST_ON_TIME_MS);
-            digitalWrite(PIN_INCREASE_POWER, LOW);
-            delay(POWER_ADJUST_OFF_TIME_MS);
-
-            if(isHighRange){
-                powerLevelHigh++;
-            } else {
-                powerLevelLow++;
+
+    // Stored calibration and press timing
+        bool readEeprom(int address, void *data, size_t size){
+            for(size_t i = 0; i < size; i++){
+                ((uint8_t *)data)[i] = EEPROM.read(address + i);
             }
-            reportPowerLevel();
+            return true; // An erased EEPROM reads as 0xFF, which the layout check rejects
         }
-        void pressPowerDec(){
-            digitalWrite(PIN_DECREASE_POWER, HIGH);
-            delay(POWER_ADJUST_ON_TIME_MS);
-            digitalWrite(PIN_DECREASE_POWER, LOW);
-            delay(POWER_ADJUST_OFF_TIME_MS);
-
-            if(isHighRange){
-                powerLevelHigh--;
-            } else {
-                powerLevelLow--;
+        void writeEeprom(int address, const void *data, size_t size){
+            for(size_t i = 0; i < size; i++){
+                EEPROM.update(address + i, ((const uint8_t *)data)[i]); // Only writes the bytes that changed
             }
-            reportPowerLevel();
         }
-        void selectRangeLow(){
-            digitalWrite(PIN_RANGE_HIGH, LOW);
-            delay(5);
-            digitalWrite(PIN_RANGE_LOW, HIGH);
-            delay(100);
-            isHighRange = false;
+        bool NanoBoard::readStorage(uint8_t /*channel*/, void *data, size_t size){
+            return readEeprom(CALIBRATION_EEPROM_ADDRESS, data, size);
         }
-        void selectRangeHigh(){
-            digitalWrite(PIN_RANGE_LOW, LOW);
-            delay(5);
-            digitalWrite(PIN_RANGE_HIGH, HIGH);
-            delay(100);
-            isHighRange = true;
+        void NanoBoard::writeStorage(uint8_t /*channel*/, const void *data, size_t size){
+            writeEeprom(CALIBRATION_EEPROM_ADDRESS, data, size);
         }
-
-    // Processing power adjustment
-        // This fucntion decides weather to call the first time or calibrated version of the function
-        void setPowerLevelFirstTime(int set_to);
-        void setPowerLevelCalibrated(int set_to);
-        void setPowerLevel(int set_to){
-            static bool is_low_calibrated = false;
-            static bool is_high_calibrated = false;
-
-            if(set_to <= 50){
-                // Low range
-                if(is_low_calibrated == false){
-                    setPowerLevelFirstTime(set_to);
-                    is_low_calibrated = true;
-                }else{
-                    setPowerLevelCalibrated(set_to);
-                }
-            } else {
-                // High range
-                if(is_high_calibrated == false){
-                    setPowerLevelFirstTime(set_to);
-                    is_high_calibrated = true;
-                }else{
-                    setPowerLevelCalibrated(set_to);
-                }
-            }
+        bool NanoBoard::readTiming(uint8_t /*channel*/, void *data, size_t size){
+            return readEeprom(TIMING_EEPROM_ADDRESS, data, size);
+        }
+        void NanoBoard::writeTiming(uint8_t /*channel*/, const void *data, size_t size){
+            writeEeprom(TIMING_EEPROM_ADDRESS, data, size);
         }
 
-        // This calibrates the power variable to the real one
-        void setPowerLevelFirstTime(int set_to){
-            // Ensure the shocker is stopped before changing power level
-                pressShockStop();
-                reportStateBusy();
-
-            // Validate and set the power level
-                if (set_to < 0 || set_to > 99) {
-                    Serial.print("Invalid power level.\n");
-                    reportStateIdle();
-                    return;
-                }
 
-            // Determine range
-                bool is_range_high = false;
-                if(set_to > 50){
-                    is_range_high = true;
-                    selectRangeHigh();
-                } else {
-                    is_range_high = false;
-                    selectRangeLow();
-                }
+    // Stack headroom
+    // Everything between the end of the variables and the top of RAM is painted before main() runs. The stack overwrites
+    // the paint as it grows down, so the paint left above the variables is the least room the stack ever had. Nothing
+    // calls malloc(), so there is no heap in between.
+        #ifdef ARDUINO_ARCH_AVR
+            extern uint8_t _end;    // First byte after .data and .bss, from the linker
+            extern uint8_t __stack; // Last byte of RAM
 
-            // Set the power level
-                if(is_range_high){
-                    // Return the power setting to a known state by going down from 99 to 51. This ensures we will allways be on power 51 when starting.
-                        powerLevelHigh = 99;
-                        while(powerLevelHigh > 51){
-                            pressPowerDec();
-                        }
-
-                    // Increase untill the desired value is reached
-                        while(powerLevelHigh < set_to){
-                            pressPowerInc();
-                        }
-                }else{
-                    // Return the power setting to a known state by going down from 50 to 0. This ensures we will allways be on power 0 when starting.
-                        powerLevelLow = 50;
-                        while(powerLevelLow > 0){
-                            pressPowerDec();
-                        }
-
-                    // Increase untill the desired value is reached
-                        while(powerLevelLow < set_to){
-                            pressPowerInc();
-                        }
+            // Placed in .init3, after the stack pointer is set up and before .data and .bss are
+            __attribute__((naked, used, section(".init3"))) void paintStack(){
+                for(uint8_t *p = &_end; p <= &__stack; p++){
+                    *p = STACK_PAINT;
                 }
+            }
 
-
-            // Report the new power level and reset state
-                reportPowerLevel();
-                reportStateIdle();
-        }
-
-        // This function assumes the power level is already calibrated
-        void setPowerLevelCalibrated(int set_to){
-            // Ensure the shocker is stopped before changing power level
-                pressShockStop();
-                reportStateBusy();
-
-            // Validate and set the power level
-                if (set_to < 0 || set_to > 99) {
-                    Serial.print("Invalid power level.\n");
-                    reportStateIdle();
-                    return;
+            uint16_t stackHeadroom(){
+                const uint8_t *p = &_end;
+                while(p <= &__stack && *p == STACK_PAINT){
+                    p++;
                 }
+                return p - &_end;
+            }
+        #endif
+
+    // Commands only this board has
+        bool NanoBoard::handleCommand(char command){
+            switch(command){
+                #ifdef ARDUINO_ARCH_AVR
+                    case 'T':
+                        // Same line as a task of the ESP32, the loop is the only task here
+                        Serial.print(F("Task loop: stack "));
+                        Serial.print(stackHeadroom());
+                        Serial.print(F(" bytes free\n"));
+                        return true;
+                #endif
 
-            // Determine target range
-            // Low range goes from 0 to 50
-            // High range goes from 51 to 99
-                bool target_range_high = (set_to > 50);
-                bool switching_ranges = (target_range_high != isHighRange);
-
-                if(target_range_high){
-                    // Switching to high range
-                    selectRangeHigh();
-                    
-                    // If we just switched ranges, recalibrate from known state
-                    if(switching_ranges){
-                        // Reset to known state (51) in high range
-                        powerLevelHigh = 99;
-                        while(powerLevelHigh > 51){
-                            pressPowerDec();
-                        }
-                    }
-                } else {
-                    // Switching to low range
-                    selectRangeLow();
-                    
-                    // If we just switched ranges, recalibrate from known state
-                    if(switching_ranges){
-                        // Reset to known state (0) in low range
-                        powerLevelLow = 50;
-                        while(powerLevelLow > 0){
-                            pressPowerDec();
-                        }
-                    }
-                }
+                default:
+                    return false;
+            }
+        }
 
-            // Set the power level
-                if(isHighRange){
-                    if(powerLevelHigh < set_to){
-                        while(powerLevelHigh < set_to){
-                            pressPowerInc();
-                        }
-                    }else{
-                        while(powerLevelHigh > set_to){
-                            pressPowerDec();
-                        }
-                    }
-                }else{
-                    if(powerLevelLow < set_to){
-                        while(powerLevelLow < set_to){
-                            pressPowerInc();
-                        }
-                    }else{
-                        while(powerLevelLow > set_to){
-                            pressPowerDec();
-                        }
-                    }
-                }
 
-            // Report the new power level and reset state
-                reportPowerLevel();
-                reportStateIdle();
+    // Idle sleep
+    // SLEEP_MODE_IDLE only stops the CPU clock. The UART, the timers and millis() keep running and every interrupt
+    // wakes it up: a byte coming in, Timer1 during a pulse, Timer2 during a press train and the Timer0 tick every 1.024 ms. So a byte is read as
+    // soon as it arrives and nothing that is due wakes up more than a tick late.
+        void sleepUntilInterrupt(){
+            if(shocker.msUntilDue(1) == 0)
+                return; // Due within the next tick
+
+            noInterrupts();
+            if(Serial.available() == 0){
+                set_sleep_mode(SLEEP_MODE_IDLE);
+                sleep_enable();
+                interrupts();
+                sleep_cpu(); // The instruction after sei always runs, a byte that came in after the check still wakes it
+                sleep_disable();
+            } else {
+                interrupts();
+            }
         }
 
 
@@ -266,73 +218,15 @@
             Serial.begin(115200);
             while (!Serial)
                 delay(10); // Wait for serial port to connect. Needed for native USB port only
-            Serial.print("\n\nSerial started!\n");
-
-        // Set pin modes
-            pinMode(PIN_LED, OUTPUT);
-            pinMode(PIN_SHOCKER, OUTPUT);
-            pinMode(PIN_INCREASE_POWER, OUTPUT);
-            pinMode(PIN_DECREASE_POWER, OUTPUT);
-            pinMode(PIN_RANGE_LOW, OUTPUT);
-            pinMode(PIN_RANGE_HIGH, OUTPUT);
-            pressShockStop();
-            selectRangeLow();
+            Serial.print(F("\n\nSerial started!\n"));
+
+        shocker.begin();
     }
 
     void loop(){
-        while(Serial.available()){
-            char pis = Serial.read();
-
-            switch(pis){
-                case '1':
-                    pressShockStart();
-                    pressShockStart();
-                    break;
-
-                case '0':
-                    pressShockStop();
-                    pressShockStop();
-                    break;
-
-                case 'P':
-                    {
-                        // Read the power level digits until we find the '!' terminator
-                        String powerStr = "";
-                        unsigned long startTime = millis();
-                        const unsigned long timeout = 1000; // 1 second timeout
-
-                        while (millis() - startTime < timeout) {
-                            if (Serial.available()) {
-                                char nextChar = Serial.read();
-                                if (nextChar == '!') {
-                                    // Found terminator, parse the power level
-                                    int powerLevel = powerStr.toInt();
-                                    if (powerLevel >= 0 && powerLevel <= 99) {
-                                        setPowerLevel(powerLevel);
-                                    } else {
-                                        Serial.print("Invalid power level range.\n");
-                                    }
-                                    break;
-                                } else if (isDigit(nextChar)) {
-                                    powerStr += nextChar;
-                                } else {
-                                    // Invalid character in power level
-                                    Serial.print("Invalid power level format.\n");
-                                    break;
-                                }
-                            }
-                        }
-
-                        // Check for timeout
-                        if (millis() - startTime >= timeout) {
-                            Serial.print("Power level command timeout.\n");
-                        }
-                    }
-                    break;
-
-                default:
-                    Serial.print("Stop pressing random buttons idiot\n");
-                    break;
-            }
-        }
-    }
\ No newline at end of file
+        shocker.update();
+        shocker.readSerial();
+        #if IDLE_SLEEP
+            sleepUntilInterrupt();
+        #endif
+    }
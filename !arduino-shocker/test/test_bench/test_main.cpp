@@ -0,0 +1,663 @@
+// Timing benchmarks run against src/main.cpp on the host, see lib/ArduinoSim.
+// All numbers are virtual time, a result above its budget fails the run.
+// The tests share one booted firmware and run in order, each starts from the state the previous one left.
+#include <Arduino.h>
+#include <ArduinoSim.h>
+#include <SerialRecorder.h>
+#include <unity.h>
+#include <stdio.h>
+#include <string>
+
+// Pins, must match src/main.cpp
+    #define PIN_SHOCKER 8
+    #define PIN_INCREASE_POWER 9
+    #define PIN_DECREASE_POWER 10
+    #define PIN_RANGE_LOW 11
+    #define PIN_RANGE_HIGH 12
+
+// Framed protocol, must match lib/ShockerCore
+    #define FRAME_START 0xA5
+    #define FRAME_SET_POWER 0x03
+    #define FRAME_SHOCK_PULSE 0x05
+    #define FRAME_ACCEPTED 0x80
+    #define FRAME_COMPLETED 0x81
+    #define FRAME_STATUS_OK 0
+    #define FRAME_METRICS 0x08
+    #define FRAME_METRICS_RESET 0x09
+    #define FRAME_METRICS_REPORT 0x83
+    #define METRICS_BUCKETS 16
+    #define FRAME_SNAPSHOT 0x0A
+    #define FRAME_SNAPSHOT_REPORT 0x84
+    #define FRAME_SET_TIMING 0x0B
+    #define FRAME_TIMING_SWEEP 0x0C
+    #define FRAME_SWEEP_REPORT 0x85
+    #define FRAME_REJECTED 0x82
+    #define FRAME_CREDIT 0x86
+
+// Budgets
+    #define BUDGET_EDGE_LATENCY_US 1000UL           // Command received to pin edge
+    #define BUDGET_REPLY_LATENCY_US 1000UL          // Command received to its serial reply
+    #define BUDGET_CALIBRATION_LOW_US 4100000UL     // First P into the low range after boot
+    #define BUDGET_CALIBRATION_HIGH_US 4000000UL    // First P into the high range after boot
+    #define BUDGET_FULL_RANGE_US 8000000UL          // 0 -> 99 or 99 -> 0
+    #define BUDGET_RANGE_CROSSING_US 300000UL       // 50 -> 51 or 51 -> 50 once both ranges are known
+    #define BUDGET_SLIDER_SETTLE_US 2100000UL       // Last command of the 20 -> 50 slider drag to the ramp being done
+    #define BUDGET_SLIDER_PRESSES 30                // Button presses for the 20 -> 50 slider drag
+    #define BUDGET_PULSE_ERROR_US 50UL              // D<ms>! pulse length against the requested length
+    #define BUDGET_STORAGE_WRITES 12UL              // EEPROM bytes written for a burst of power changes
+    #define BUDGET_REBOOT_POWER_CHANGE_US 500000UL  // 40 -> 45 after a reboot, no homing
+    #define BUDGET_LOOP_US 1024UL                   // Slowest loop pass the device recorded, bucket bound
+    #define BUDGET_IDLE_AWAKE_PERMILLE 50UL         // Share of an idle stretch the CPU isn't asleep
+    #define BUDGET_WAKE_EDGE_US 100UL               // Command received after an idle stretch to pin edge
+    #define BUDGET_PRESS_ERROR_US 1100UL            // Press and gap length against the set timing, one Timer0 tick
+
+    #define POWER_CHANGE_TIMEOUT_US 60000000ULL
+    #define CALIBRATION_SAVE_DELAY_US 5000000ULL // Must match CALIBRATION_SAVE_DELAY_MS in lib/ShockerCore
+
+
+// Helpers
+    void setUp(){}
+    void tearDown(){}
+
+    void report(const char *name, uint64_t us){
+        printf("[bench] %-44s %10.3f ms\n", name, us / 1000.0);
+    }
+
+    // Runs until the "B" that follows the final P<level>! report, returns its time
+    uint64_t waitForPowerLevel(int level, size_t cursor){
+        char text[8];
+        snprintf(text, sizeof(text), "P%d!", level);
+        uint64_t done = 0;
+
+        bool finished = sim::runUntil([&]{
+            const std::vector<sim::SerialLine> &lines = sim::serialLines();
+            for(; cursor + 1 < lines.size(); cursor++){
+                if(lines[cursor].text == text && lines[cursor + 1].text == "B"){
+                    done = lines[cursor + 1].timeUs;
+                    return true;
+                }
+            }
+            return false;
+        }, POWER_CHANGE_TIMEOUT_US);
+
+        TEST_ASSERT_TRUE_MESSAGE(finished, text);
+        return done;
+    }
+
+    // Sends P<level>! and returns the time from its last byte until the power change is reported done
+    uint64_t timePowerChange(int level){
+        char command[8];
+        snprintf(command, sizeof(command), "P%d!", level);
+
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial(command);
+        return waitForPowerLevel(level, cursor) - sent;
+    }
+
+    // Sends a command and returns the time from its last byte to the first edge on any of the given pins
+    uint64_t timeToEdge(const char *command, const uint8_t *pins, size_t pin_count){
+        size_t cursor = sim::pinEdges().size();
+        uint64_t sent = sim::sendSerial(command);
+        uint64_t edge = 0;
+
+        bool found = sim::runUntil([&]{
+            const std::vector<sim::PinEdge> &edges = sim::pinEdges();
+            for(; cursor < edges.size(); cursor++){
+                for(size_t i = 0; i < pin_count; i++){
+                    if(edges[cursor].pin == pins[i] && edges[cursor].timeUs >= sent){
+                        edge = edges[cursor].timeUs;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }, 1000000);
+
+        TEST_ASSERT_TRUE_MESSAGE(found, command);
+        return edge - sent;
+    }
+
+    // Sends a command and returns the time from its last byte to the next serial line.
+    // Status frames of a running ramp that go out while the command is still arriving don't count.
+    uint64_t timeToReply(const char *command){
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial(command);
+        uint64_t reply = 0;
+
+        bool replied = sim::runUntil([&]{
+            const std::vector<sim::SerialLine> &lines = sim::serialLines();
+            for(; cursor < lines.size(); cursor++){
+                if(lines[cursor].timeUs >= sent){
+                    reply = lines[cursor].timeUs;
+                    return true;
+                }
+            }
+            return false;
+        }, 1000000);
+
+        TEST_ASSERT_TRUE_MESSAGE(replied, command);
+        return reply - sent;
+    }
+
+    void checkBudget(const char *name, uint64_t us, uint64_t budget){
+        report(name, us);
+        TEST_ASSERT_TRUE_MESSAGE(us <= budget, name);
+    }
+
+    // Counts the power button presses from the given pin edge index on
+    size_t countPresses(size_t from){
+        const std::vector<sim::PinEdge> &edges = sim::pinEdges();
+        size_t presses = 0;
+        for(size_t i = from; i < edges.size(); i++){
+            bool power_button = edges[i].pin == PIN_INCREASE_POWER || edges[i].pin == PIN_DECREASE_POWER;
+            if(power_button && edges[i].level == HIGH){
+                presses++;
+            }
+        }
+        return presses;
+    }
+
+
+    uint8_t frameCrc8(const uint8_t *data, size_t length){
+        uint8_t crc = 0;
+        for(size_t i = 0; i < length; i++){
+            crc ^= data[i];
+            for(uint8_t bit = 0; bit < 8; bit++){
+                crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    // Sends a command frame the way the host does, returns the time its last byte is readable
+    uint64_t sendCommandFrame(uint8_t opcode, uint8_t sequence, const uint8_t *payload, uint8_t length){
+        std::vector<uint8_t> frame = { FRAME_START, length, opcode, sequence };
+        frame.insert(frame.end(), payload, payload + length);
+        frame.push_back(frameCrc8(&frame[1], frame.size() - 1));
+        return sim::sendSerial(frame.data(), frame.size());
+    }
+
+    // Returns the first frame with the given opcode and sequence from index from on, nullptr if none
+    const sim::SerialFrame *findFrame(uint8_t opcode, uint8_t sequence, size_t from){
+        const std::vector<sim::SerialFrame> &frames = sim::serialFrames();
+        for(size_t i = from; i < frames.size(); i++){
+            if(frames[i].bytes[2] == opcode && frames[i].bytes[3] == sequence){
+                return &frames[i];
+            }
+        }
+        return nullptr;
+    }
+
+
+    // Runs until the shocker goes low again after its first rising edge at or after afterUs, returns the pulse length
+    uint64_t measurePulse(uint64_t afterUs){
+        int64_t rise = -1;
+        int64_t fall = -1;
+        bool ended = sim::runUntil([&]{
+            rise = sim::findEdge(PIN_SHOCKER, HIGH, afterUs);
+            fall = rise < 0 ? -1 : sim::findEdge(PIN_SHOCKER, LOW, rise);
+            return fall >= 0;
+        }, POWER_CHANGE_TIMEOUT_US);
+
+        TEST_ASSERT_TRUE_MESSAGE(ended, "shocker pulse");
+        return fall - rise;
+    }
+
+    uint64_t difference(uint64_t a, uint64_t b){
+        return a > b ? a - b : b - a;
+    }
+
+    // Largest difference between a press or the gap before it on pin from the given edge index on and the timing
+    uint64_t worstPressError(uint8_t pin, size_t from, uint8_t on_ms, uint8_t off_ms){
+        const std::vector<sim::PinEdge> &edges = sim::pinEdges();
+        uint64_t worst_error = 0;
+        int64_t last_rise = -1;
+        int64_t last_fall = -1;
+        for(size_t i = from; i < edges.size(); i++){
+            if(edges[i].pin != pin)
+                continue;
+            uint64_t error = 0;
+            if(edges[i].level == HIGH){
+                error = last_fall < 0 ? 0 : difference(edges[i].timeUs - last_fall, off_ms * 1000ULL);
+                last_rise = edges[i].timeUs;
+            } else if(last_rise >= 0){
+                error = difference(edges[i].timeUs - last_rise, on_ms * 1000ULL);
+                last_fall = edges[i].timeUs;
+            }
+            worst_error = error > worst_error ? error : worst_error;
+        }
+        return worst_error;
+    }
+
+    // A FRAME_METRICS_REPORT taken apart, see Metrics in lib/ShockerCore
+    struct Metrics {
+        uint32_t edgeLatencyUs[METRICS_BUCKETS];
+        uint32_t rampMs[METRICS_BUCKETS];
+        uint32_t loopUs[METRICS_BUCKETS];
+        uint32_t rxOverflows;
+    };
+    Metrics queryMetrics(uint8_t sequence){
+        size_t frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_METRICS, sequence, nullptr, 0);
+        bool replied = sim::runUntil([&]{ return findFrame(FRAME_METRICS_REPORT, sequence, frames) != nullptr; }, 1000000);
+        TEST_ASSERT_TRUE_MESSAGE(replied, "metrics report");
+
+        const std::vector<uint8_t> &bytes = findFrame(FRAME_METRICS_REPORT, sequence, frames)->bytes;
+        TEST_ASSERT_EQUAL(5 + 3 * METRICS_BUCKETS * 2 + 2, bytes.size());
+        Metrics metrics;
+        uint32_t *histograms[] = { metrics.edgeLatencyUs, metrics.rampMs, metrics.loopUs };
+        const uint8_t *payload = &bytes[4];
+        for(uint32_t *counts : histograms){
+            for(int i = 0; i < METRICS_BUCKETS; i++, payload += 2){
+                counts[i] = payload[0] | payload[1] << 8;
+            }
+        }
+        metrics.rxOverflows = payload[0] | payload[1] << 8;
+        return metrics;
+    }
+    uint32_t histogramCount(const uint32_t *counts){
+        uint32_t total = 0;
+        for(int i = 0; i < METRICS_BUCKETS; i++)
+            total += counts[i];
+        return total;
+    }
+    // Upper bound of the highest bucket in use
+    uint64_t histogramBound(const uint32_t *counts){
+        for(int i = METRICS_BUCKETS - 1; i >= 0; i--){
+            if(counts[i] > 0)
+                return 1ULL << i;
+        }
+        return 0;
+    }
+
+
+    // Sends bytes the way a host that keeps to the credit does (see Flow control in lib/ShockerCore), after lining its
+    // count up with the board's through a snapshot. Returns the time the last byte is readable.
+    uint64_t sendWithCredit(const std::string &bytes, uint8_t sequence){
+        size_t frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_SNAPSHOT, sequence, nullptr, 0);
+        bool replied = sim::runUntil([&]{ return findFrame(FRAME_SNAPSHOT_REPORT, sequence, frames) != nullptr; }, 1000000);
+        TEST_ASSERT_TRUE_MESSAGE(replied, "snapshot report");
+        const sim::SerialFrame *report = findFrame(FRAME_SNAPSHOT_REPORT, sequence, frames);
+        uint16_t credit = report->bytes[21] | report->bytes[22] << 8;
+        uint16_t sent = report->bytes[23] | report->bytes[24] << 8;
+        uint16_t read = sent;
+
+        frames = report - sim::serialFrames().data();
+        size_t next = 0;
+        uint64_t last = 0;
+        while(next < bytes.size()){
+            const std::vector<sim::SerialFrame> &all = sim::serialFrames();
+            for(; frames < all.size(); frames++){
+                if(all[frames].bytes[2] == FRAME_CREDIT){
+                    read = all[frames].bytes[4] | all[frames].bytes[5] << 8;
+                }
+            }
+            size_t room = credit - (uint16_t)(sent - read);
+            if(room == 0){
+                sim::runForUs(100);
+                continue;
+            }
+            size_t length = bytes.size() - next < room ? bytes.size() - next : room;
+            last = sim::sendSerial((const uint8_t *)bytes.data() + next, length);
+            sent += length;
+            next += length;
+        }
+        return last;
+    }
+
+
+// Benchmarks
+    void test_calibration_low(){
+        checkBudget("calibration, first P0 after boot", timePowerChange(0), BUDGET_CALIBRATION_LOW_US);
+    }
+
+    void test_calibration_high(){
+        checkBudget("calibration, first P51 after boot", timePowerChange(51), BUDGET_CALIBRATION_HIGH_US);
+    }
+
+    void test_full_range(){
+        timePowerChange(0);
+        checkBudget("power change 0 -> 99", timePowerChange(99), BUDGET_FULL_RANGE_US);
+        checkBudget("power change 99 -> 0", timePowerChange(0), BUDGET_FULL_RANGE_US);
+    }
+
+    void test_range_crossing(){
+        // Each range keeps its counter, so crossing 50/51 back and forth only costs the range switch
+        timePowerChange(51);
+        timePowerChange(50);
+        checkBudget("power change 50 -> 51", timePowerChange(51), BUDGET_RANGE_CROSSING_US);
+        checkBudget("power change 51 -> 50", timePowerChange(50), BUDGET_RANGE_CROSSING_US);
+    }
+
+    void test_shock_latency(){
+        const uint8_t shocker[] = { PIN_SHOCKER };
+        checkBudget("start command to shocker edge", timeToEdge("1", shocker, 1), BUDGET_EDGE_LATENCY_US);
+        checkBudget("stop command to shocker edge", timeToEdge("0", shocker, 1), BUDGET_EDGE_LATENCY_US);
+    }
+
+    void test_power_latency(){
+        const uint8_t actuator[] = { PIN_INCREASE_POWER, PIN_DECREASE_POWER, PIN_RANGE_LOW, PIN_RANGE_HIGH };
+        size_t cursor = sim::serialLines().size();
+        checkBudget("power command to first button edge", timeToEdge("P20!", actuator, 4), BUDGET_EDGE_LATENCY_US);
+        waitForPowerLevel(20, cursor);
+    }
+
+    void test_slider_burst(){
+        // Dragging the slider from 20 to 50 sends a power command every 30 ms
+        size_t cursor = sim::serialLines().size();
+        size_t edges = sim::pinEdges().size();
+        uint64_t start = sim::nowUs();
+        uint64_t sent = 0;
+        for(int level = 22; level <= 50; level += 2){
+            char command[8];
+            snprintf(command, sizeof(command), "P%d!", level);
+            sent = sim::sendSerialAt(start + (level - 22) / 2 * 30000ULL, command);
+        }
+
+        checkBudget("slider drag 20 -> 50, last command to settled", waitForPowerLevel(50, cursor) - sent, BUDGET_SLIDER_SETTLE_US);
+
+        size_t presses = countPresses(edges);
+        printf("[bench] %-44s %10u presses\n", "slider drag 20 -> 50", (unsigned)presses);
+        TEST_ASSERT_TRUE_MESSAGE(presses <= BUDGET_SLIDER_PRESSES, "slider drag presses");
+    }
+
+    void test_framed_power(){
+        size_t cursor = sim::serialLines().size();
+        size_t frames = sim::serialFrames().size();
+        uint8_t level = 30;
+        uint64_t sent = sendCommandFrame(FRAME_SET_POWER, 7, &level, 1);
+        uint64_t done = waitForPowerLevel(30, cursor);
+
+        const sim::SerialFrame *accepted = findFrame(FRAME_ACCEPTED, 7, frames);
+        const sim::SerialFrame *completed = findFrame(FRAME_COMPLETED, 7, frames);
+        TEST_ASSERT_TRUE_MESSAGE(accepted && completed, "framed power replies");
+
+        checkBudget("framed power command to accepted frame", accepted->timeUs - sent, BUDGET_REPLY_LATENCY_US);
+        checkBudget("framed power ramp done to completed frame", completed->timeUs - done, BUDGET_REPLY_LATENCY_US);
+        TEST_ASSERT_EQUAL(FRAME_STATUS_OK, completed->bytes[4]);
+        TEST_ASSERT_EQUAL(30, completed->bytes[5]);
+    }
+
+    void test_stop_during_ramp(){
+        size_t cursor = sim::serialLines().size();
+        sim::sendSerial("P99!");
+        sim::runForUs(1000000);
+        checkBudget("stop command to reply during a ramp", timeToReply("0"), BUDGET_REPLY_LATENCY_US);
+        waitForPowerLevel(99, cursor);
+        TEST_ASSERT_EQUAL(LOW, sim::pinLevel(PIN_SHOCKER));
+    }
+
+    void test_pulse_timing(){
+        uint64_t sent = sim::sendSerial("D250!");
+        checkBudget("D250! pulse length error", difference(measurePulse(sent), 250000), BUDGET_PULSE_ERROR_US);
+
+        // The timer ends the pulse, a loop() that stalls for 50 ms at a time must not stretch it
+        sim::setLoopCostUs(50000);
+        sent = sim::sendSerial("D250!");
+        checkBudget("D250! pulse length error, 50 ms loop stalls", difference(measurePulse(sent), 250000), BUDGET_PULSE_ERROR_US);
+        sim::setLoopCostUs(10);
+
+        size_t frames = sim::serialFrames().size();
+        const uint8_t length[] = { 1000 & 0xFF, 1000 >> 8 };
+        sent = sendCommandFrame(FRAME_SHOCK_PULSE, 9, length, 2);
+        checkBudget("framed 1000 ms pulse length error", difference(measurePulse(sent), 1000000), BUDGET_PULSE_ERROR_US);
+        sim::runForUs(1000);
+        const sim::SerialFrame *completed = findFrame(FRAME_COMPLETED, 9, frames);
+        TEST_ASSERT_TRUE_MESSAGE(completed, "framed pulse completed");
+        TEST_ASSERT_EQUAL(FRAME_STATUS_OK, completed->bytes[4]);
+
+        // A stop cuts the pulse short
+        sent = sim::sendSerial("D1000!");
+        sim::sendSerialAt(sent + 100000, "0");
+        TEST_ASSERT_TRUE_MESSAGE(measurePulse(sent) < 101000, "stop during a pulse");
+    }
+
+    void test_stored_calibration(){
+        // A burst of power changes is saved once, after the power has been idle for a while
+        uint64_t writes = sim::eepromWrites();
+        timePowerChange(35);
+        timePowerChange(40);
+        sim::runForUs(CALIBRATION_SAVE_DELAY_US + 1000000);
+        uint64_t written = sim::eepromWrites() - writes;
+        printf("[bench] %-44s %10u bytes\n", "EEPROM bytes written, two power changes", (unsigned)written);
+        TEST_ASSERT_TRUE_MESSAGE(written <= BUDGET_STORAGE_WRITES, "storage writes");
+
+        // The next boot trusts the stored power level instead of homing again
+        sim::boot();
+        checkBudget("power change 40 -> 45 after a reboot", timePowerChange(45), BUDGET_REBOOT_POWER_CHANGE_US);
+    }
+
+    void test_metrics(){
+        // Cleared, then a start, a stop, a pulse and a power change
+        size_t frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_METRICS_RESET, 40, nullptr, 0);
+        sim::runForUs(10000);
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_COMPLETED, 40, frames), "metrics reset");
+        sim::sendSerial("1");
+        sim::sendSerial("0");
+        sim::sendSerial("D20!");
+        timePowerChange(50);
+
+        Metrics metrics = queryMetrics(41);
+        TEST_ASSERT_EQUAL_MESSAGE(3, histogramCount(metrics.edgeLatencyUs), "edge latencies recorded");
+        TEST_ASSERT_EQUAL_MESSAGE(1, histogramCount(metrics.rampMs), "ramps recorded");
+        TEST_ASSERT_EQUAL(0, metrics.rxOverflows);
+        checkBudget("device histogram, slowest command to edge", histogramBound(metrics.edgeLatencyUs), BUDGET_EDGE_LATENCY_US);
+        checkBudget("device histogram, slowest loop", histogramBound(metrics.loopUs), BUDGET_LOOP_US);
+
+        // A loop that stalls for 20 ms at a time lets the 127 byte RX buffer fill up at 115200 baud
+        sim::setSerialRxBufferSize(SERIAL_RX_BUFFER_SIZE - 1);
+        sim::setLoopCostUs(20000);
+        for(int i = 0; i < 200; i++){
+            sim::sendSerial("0");
+        }
+        sim::runForUs(100000);
+        sim::setLoopCostUs(10);
+        sim::runForUs(100000);
+        metrics = queryMetrics(42);
+        printf("[bench] %-44s %10u overflows\n", "device RX overflows, 20 ms loop stalls", (unsigned)metrics.rxOverflows);
+        TEST_ASSERT_TRUE_MESSAGE(sim::serialRxDropped() > 0 && metrics.rxOverflows > 0, "RX overflow counted");
+
+        sendCommandFrame(FRAME_METRICS_RESET, 43, nullptr, 0);
+        TEST_ASSERT_EQUAL_MESSAGE(0, queryMetrics(44).rxOverflows, "RX overflows reset");
+        sim::setSerialRxBufferSize(0);
+    }
+
+    void test_handshake(){
+        // The banner went out on the last boot, before anything else the firmware has to say
+        const std::vector<sim::SerialLine> &lines = sim::serialLines();
+        size_t banner = 0;
+        while(banner < lines.size() && lines[banner].text.rfind("Ready ", 0) != 0)
+            banner++;
+        TEST_ASSERT_TRUE_MESSAGE(banner < lines.size(), "ready banner");
+        TEST_ASSERT_EQUAL_STRING("Ready ciab-shocker 1.3 board=nano channels=1 ranges=2 patterns=2 caps=frames,snapshot,timing,metrics,credit",
+            lines[banner].text.c_str());
+
+        // A host that opens the port without a reset asks for the state instead, test_metrics left the power at 50
+        size_t frames = sim::serialFrames().size();
+        uint64_t sent = sendCommandFrame(FRAME_SNAPSHOT, 50, nullptr, 0);
+        bool replied = sim::runUntil([&]{ return findFrame(FRAME_SNAPSHOT_REPORT, 50, frames) != nullptr; }, 1000000);
+        TEST_ASSERT_TRUE_MESSAGE(replied, "snapshot report");
+        const sim::SerialFrame *report = findFrame(FRAME_SNAPSHOT_REPORT, 50, frames);
+        checkBudget("snapshot reply latency", report->timeUs - sent, BUDGET_REPLY_LATENCY_US);
+
+        const uint8_t expected_head[] = { 1, 3, 1, 0 }; // Version 1.3, one channel, idle
+        TEST_ASSERT_EQUAL(21, report->bytes[1]);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected_head, &report->bytes[4], sizeof(expected_head));
+        uint32_t uptime_ms = report->bytes[9] | report->bytes[10] << 8 | report->bytes[11] << 16 | (uint32_t)report->bytes[12] << 24;
+        TEST_ASSERT_UINT32_WITHIN(2, sim::nowUs() / 1000, uptime_ms);
+        const uint8_t expected_ranges[] = { 0, 2, 50, 1, 99, 1 }; // Low range selected, the high one where test_stop_during_ramp left it
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected_ranges, &report->bytes[13], sizeof(expected_ranges));
+        TEST_ASSERT_EQUAL_MESSAGE(40, report->bytes[19], "board press on time");
+        TEST_ASSERT_EQUAL_MESSAGE(40, report->bytes[20], "board press off time");
+        TEST_ASSERT_EQUAL_MESSAGE(SERIAL_RX_BUFFER_SIZE - 1 - 2, report->bytes[21] | report->bytes[22] << 8, "credit");
+
+        // Commands that can't be run are answered with an error code, the power stays where it was
+        size_t cursor = lines.size();
+        sim::sendSerial("P100!XPq");
+        bool answered = sim::runUntil([&]{ return sim::findLine("E6P", cursor) >= 0; }, 1000000);
+        TEST_ASSERT_TRUE_MESSAGE(answered, "error lines");
+        TEST_ASSERT_TRUE(sim::findLine("E2", cursor) >= 0);
+        TEST_ASSERT_TRUE(sim::findLine("E1", cursor) >= 0);
+    }
+
+    void test_press_timing(){
+        // A new timing is used by the next ramp, test_metrics left the power at 50
+        size_t frames = sim::serialFrames().size();
+        const uint8_t timing[] = { 20, 25 };
+        sendCommandFrame(FRAME_SET_TIMING, 60, timing, sizeof(timing));
+        sim::runForUs(10000);
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_COMPLETED, 60, frames), "timing set");
+
+        size_t cursor = sim::pinEdges().size();
+        timePowerChange(45);
+        TEST_ASSERT_EQUAL_MESSAGE(5, countPresses(cursor), "presses 50 -> 45");
+        checkBudget("press timing error, 20/25 ms", worstPressError(PIN_DECREASE_POWER, cursor, timing[0], timing[1]), BUDGET_PRESS_ERROR_US);
+
+        // The press timer keeps the timing through loop stalls
+        sim::setLoopCostUs(50000);
+        cursor = sim::pinEdges().size();
+        timePowerChange(50);
+        sim::setLoopCostUs(10);
+        TEST_ASSERT_EQUAL_MESSAGE(5, countPresses(cursor), "presses 45 -> 50");
+        checkBudget("press timing error, 50 ms loop stalls", worstPressError(PIN_INCREASE_POWER, cursor, timing[0], timing[1]), BUDGET_PRESS_ERROR_US);
+
+        // It is stored, and rejected when out of range
+        sim::boot();
+        frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_SNAPSHOT, 61, nullptr, 0);
+        const uint8_t too_long[] = { 20, 251 };
+        sendCommandFrame(FRAME_SET_TIMING, 62, too_long, sizeof(too_long));
+        sim::runForUs(10000);
+        const sim::SerialFrame *report = findFrame(FRAME_SNAPSHOT_REPORT, 61, frames);
+        TEST_ASSERT_NOT_NULL(report);
+        TEST_ASSERT_EQUAL(20, report->bytes[19]);
+        TEST_ASSERT_EQUAL(25, report->bytes[20]);
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_REJECTED, 62, frames), "timing out of range");
+
+        // A sweep over 20 and 40 ms presses 5 times with each of the four pairs, then leaves the power at the bottom
+        frames = sim::serialFrames().size();
+        const uint8_t sweep[] = { 20, 40, 20, 5 };
+        sendCommandFrame(FRAME_TIMING_SWEEP, 63, sweep, sizeof(sweep));
+        bool finished = sim::runUntil([&]{ return findFrame(FRAME_COMPLETED, 63, frames) != nullptr; }, POWER_CHANGE_TIMEOUT_US);
+        TEST_ASSERT_TRUE_MESSAGE(finished, "sweep completed");
+        TEST_ASSERT_EQUAL(FRAME_STATUS_OK, findFrame(FRAME_COMPLETED, 63, frames)->bytes[4]);
+
+        const uint8_t expected_timings[][2] = { { 20, 20 }, { 20, 40 }, { 40, 20 }, { 40, 40 } };
+        size_t reports = 0;
+        for(size_t i = frames; i < sim::serialFrames().size(); i++){
+            const std::vector<uint8_t> &bytes = sim::serialFrames()[i].bytes;
+            if(bytes[2] != FRAME_SWEEP_REPORT || bytes[3] != 63)
+                continue;
+            TEST_ASSERT_TRUE(reports < 4);
+            TEST_ASSERT_EQUAL(expected_timings[reports][0], bytes[4]);
+            TEST_ASSERT_EQUAL(expected_timings[reports][1], bytes[5]);
+            TEST_ASSERT_EQUAL(5, bytes[6]);
+            uint16_t elapsed_ms = bytes[7] | bytes[8] << 8;
+            uint16_t expected_ms = 5 * (bytes[4] + bytes[5]);
+            printf("[bench] %-44s %10u ms\n", "sweep, 5 presses", (unsigned)elapsed_ms);
+            TEST_ASSERT_TRUE_MESSAGE(elapsed_ms >= expected_ms - bytes[5] && elapsed_ms <= expected_ms + 10, "sweep elapsed");
+            reports++;
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(4, reports, "sweep reports");
+        timePowerChange(40);
+    }
+
+    void test_idle_sleep(){
+        // Idle, the CPU only wakes up for the Timer0 tick
+        sim::runForUs(CALIBRATION_SAVE_DELAY_US + 1000000);
+        uint64_t start = sim::nowUs();
+        uint64_t slept = sim::sleptUs();
+        sim::runForUs(10000000);
+        uint64_t awake_permille = 1000 - (sim::sleptUs() - slept) * 1000 / (sim::nowUs() - start);
+        printf("[bench] %-44s %10.1f %%\n", "CPU awake while idle", awake_permille / 10.0);
+        TEST_ASSERT_TRUE_MESSAGE(awake_permille <= BUDGET_IDLE_AWAKE_PERMILLE, "CPU awake while idle");
+
+        // A command wakes it up as it comes in
+        const uint8_t shocker_pin[] = { PIN_SHOCKER };
+        checkBudget("start command to shocker edge, asleep", timeToEdge("1", shocker_pin, 1), BUDGET_WAKE_EDGE_US);
+        sim::runForUs(10000000);
+        checkBudget("stop command to shocker edge, asleep", timeToEdge("0", shocker_pin, 1), BUDGET_WAKE_EDGE_US);
+    }
+
+    void test_flow_control(){
+        // A host that keeps to the credit loses nothing however long the loop stalls, test_recorder left the power at 45
+        sim::setSerialRxBufferSize(SERIAL_RX_BUFFER_SIZE - 1);
+        sim::setLoopCostUs(20000);
+        uint64_t dropped = sim::serialRxDropped();
+        size_t cursor = sim::serialLines().size();
+        std::string burst(1000, '0');
+        burst += "P40!";
+        uint64_t start = sim::nowUs();
+        uint64_t sent = sendWithCredit(burst, 70);
+        printf("[bench] %-44s %10.0f B/s\n", "ingest rate keeping to the credit, 20 ms stalls", burst.size() * 1e6 / (sent - start));
+        sim::setLoopCostUs(10);
+        waitForPowerLevel(40, cursor);
+        sim::setSerialRxBufferSize(0);
+        TEST_ASSERT_EQUAL_MESSAGE(dropped, sim::serialRxDropped(), "bytes dropped");
+    }
+
+    void test_retarget_during_settle(){
+        // Going back below 51 while the high range selector settles has to end with the low range selected
+        size_t cursor = sim::serialLines().size();
+        sim::sendSerial("P30!");
+        waitForPowerLevel(30, cursor);
+
+        cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial("P60!");
+        sim::sendSerialAt(sent + 50000, "P30!");
+        waitForPowerLevel(30, cursor);
+        TEST_ASSERT_EQUAL_MESSAGE(HIGH, sim::pinLevel(PIN_RANGE_LOW), "low range selected");
+        TEST_ASSERT_EQUAL_MESSAGE(LOW, sim::pinLevel(PIN_RANGE_HIGH), "high range released");
+    }
+
+    void test_recorder(){
+        // Bytes that come back to back share a burst, the oldest bursts make room once the ring is full
+        SerialRecorder<2 * (5 + 32)> recorder;
+        for(const char *c = "P20!"; *c; c++){
+            recorder.add(*c, 1000);
+        }
+        recorder.add('1', 1010);
+        for(int i = 0; i < 60; i++){
+            recorder.add('0' + i % 10, 2000 + i / 30);
+        }
+        std::string dump;
+        recorder.forEachBurst([&](unsigned long ms, const uint8_t *bytes, uint8_t length){
+            dump += "@" + std::to_string(ms) + " " + std::string((const char *)bytes, length) + "\n";
+        });
+        TEST_ASSERT_EQUAL_STRING("@2000 01234567890123456789012345678901\n@2001 2345678901234567890123456789\n", dump.c_str());
+
+        // A replayed line arrives at the time it was recorded, test_press_timing left the power at 40
+        uint64_t at_ms = sim::nowUs() / 1000 + 10;
+        std::string recording = "Ready ciab-shocker\n@" + std::to_string(at_ms) + " 50343521\r\n@end\n";
+        size_t cursor = sim::serialLines().size();
+        TEST_ASSERT_EQUAL_UINT64(at_ms * 1000 + 4 * (10000000 / 115200), sim::replayRecording(recording));
+        waitForPowerLevel(45, cursor);
+    }
+
+
+int main(){
+    sim::boot();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_calibration_low);
+    RUN_TEST(test_calibration_high);
+    RUN_TEST(test_full_range);
+    RUN_TEST(test_range_crossing);
+    RUN_TEST(test_shock_latency);
+    RUN_TEST(test_power_latency);
+    RUN_TEST(test_slider_burst);
+    RUN_TEST(test_framed_power);
+    RUN_TEST(test_stop_during_ramp);
+    RUN_TEST(test_pulse_timing);
+    RUN_TEST(test_stored_calibration);
+    RUN_TEST(test_metrics);
+    RUN_TEST(test_handshake);
+    RUN_TEST(test_press_timing);
+    RUN_TEST(test_idle_sleep);
+    RUN_TEST(test_recorder);
+    RUN_TEST(test_flow_control);
+    RUN_TEST(test_retarget_during_settle);
+    return UNITY_END();
+}
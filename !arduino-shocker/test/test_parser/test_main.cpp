@@ -0,0 +1,198 @@
+// Fuzz run and throughput benchmark for lib/CommandParser, plus random serial input against src/main.cpp on the host.
+// The random streams come from a fixed seed so a failure always reproduces.
+#include <Arduino.h>
+#include <ArduinoSim.h>
+#include <CommandParser.h>
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+// Must match src/main.cpp and lib/ShockerCore
+    #define PIN_SHOCKER 8
+    #define FRAME_MAX_PAYLOAD 2 // Longest fuzzed frame, the firmware takes longer ones for pattern uploads
+    #define POWER_COMMAND_TIMEOUT_MS 1000
+    #define FRAME_TIMEOUT_MS 100
+
+// Budgets
+    #define FUZZ_ROUNDS 200000
+    #define FUZZ_SERIAL_BYTES 20000                // Random bytes sent to the firmware
+    #define BUDGET_PARSER_BYTES_PER_S 1000000.0    // Host throughput, about 100x a 115200 baud link
+    #define POWER_CHANGE_TIMEOUT_US 120000000ULL
+
+    typedef CommandParser<FRAME_MAX_PAYLOAD> Parser;
+
+
+// Helpers
+    void setUp(){}
+    void tearDown(){}
+
+    uint32_t randomState = 0x12345678;
+    uint32_t nextRandom(){
+        // xorshift32
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return randomState;
+    }
+
+    // Appends a valid command: a single character, a number command or a frame
+    void appendCommand(std::vector<uint8_t> &out){
+        switch(nextRandom() % 3){
+            case 0:
+                out.push_back("01CV"[nextRandom() % 4]);
+                break;
+
+            case 1:
+                {
+                    char text[12];
+                    int length = snprintf(text, sizeof(text), "%c%u!", nextRandom() % 2 ? 'P' : 'D', (unsigned)(nextRandom() % 100000));
+                    out.insert(out.end(), text, text + length);
+                }
+                break;
+
+            case 2:
+                {
+                    uint8_t length = nextRandom() % (FRAME_MAX_PAYLOAD + 1);
+                    size_t start = out.size();
+                    out.push_back(PARSER_FRAME_START);
+                    out.push_back(length);
+                    out.push_back(nextRandom() % 8);   // Opcode
+                    out.push_back(nextRandom() % 256); // Sequence
+                    for(uint8_t i = 0; i < length; i++)
+                        out.push_back(nextRandom() % 256);
+                    out.push_back(crc8(&out[start + 1], 3 + length));
+                }
+                break;
+        }
+    }
+
+    // Checks what a result may claim about the parser
+    bool resultIsConsistent(const Parser &parser, ParseResult result){
+        if(parser.digits > PARSER_MAX_DIGITS || parser.received > sizeof(parser.frame))
+            return false;
+
+        switch(result){
+            case ParseResult::NUMBER:
+                return (parser.command == 'P' || parser.command == 'D') && parser.number <= 99999;
+            case ParseResult::FRAME:
+                return parser.frameLength() <= FRAME_MAX_PAYLOAD
+                    && crc8(parser.frame, 3 + parser.frameLength()) == parser.frame[3 + parser.frameLength()];
+            default:
+                return true;
+        }
+    }
+
+
+// Tests
+    void test_parser_fuzz(){
+        Parser parser("PD", POWER_COMMAND_TIMEOUT_MS, FRAME_TIMEOUT_MS);
+        unsigned long now_ms = 0;
+        size_t inconsistent = 0;
+        size_t lost = 0;
+
+        for(uint32_t round = 0; round < FUZZ_ROUNDS; round++){
+            // Garbage, sometimes with a valid command in it, with random gaps in time
+            uint32_t garbage = nextRandom() % 16;
+            for(uint32_t i = 0; i < garbage; i++){
+                std::vector<uint8_t> bytes;
+                if(nextRandom() % 4 == 0){
+                    appendCommand(bytes);
+                } else {
+                    bytes.push_back(nextRandom() % 256);
+                }
+                for(uint8_t c : bytes){
+                    now_ms += nextRandom() % 4 == 0 ? nextRandom() % 1500 : 0;
+                    ParseResult timeout = parser.poll(now_ms);
+                    ParseResult result = parser.feed(c, now_ms);
+                    if(!resultIsConsistent(parser, timeout) || !resultIsConsistent(parser, result))
+                        inconsistent++;
+                }
+            }
+
+            // Whatever came before, a valid command parses once the parser has timed out of any half command
+            now_ms += POWER_COMMAND_TIMEOUT_MS;
+            parser.poll(now_ms);
+            uint32_t level = nextRandom() % 100;
+            char command[8];
+            int length = snprintf(command, sizeof(command), "P%u!", (unsigned)level);
+            ParseResult result = ParseResult::NONE;
+            for(int i = 0; i < length; i++)
+                result = parser.feed(command[i], now_ms);
+            if(result != ParseResult::NUMBER || parser.command != 'P' || parser.number != level)
+                lost++;
+        }
+
+        printf("[bench] %-44s %10u rounds\n", "parser fuzz", (unsigned)FUZZ_ROUNDS);
+        TEST_ASSERT_EQUAL_MESSAGE(0u, inconsistent, "parser results consistent");
+        TEST_ASSERT_EQUAL_MESSAGE(0u, lost, "parser resynchronises");
+    }
+
+    void test_firmware_fuzz(){
+        // Random bytes with the odd valid command, the firmware has to stay responsive through all of it
+        std::vector<uint8_t> bytes;
+        while(bytes.size() < FUZZ_SERIAL_BYTES){
+            if(nextRandom() % 8 == 0){
+                appendCommand(bytes);
+            } else {
+                bytes.push_back(nextRandom() % 256);
+            }
+        }
+        uint64_t sent = sim::sendSerial(bytes.data(), bytes.size());
+        sim::runForUs(sent - sim::nowUs() + POWER_COMMAND_TIMEOUT_MS * 1000ULL);
+
+        // A stop still releases the shocker and a power command still completes
+        sim::sendSerial("0");
+        sim::runForUs(1000);
+        TEST_ASSERT_EQUAL(LOW, sim::pinLevel(PIN_SHOCKER));
+
+        size_t cursor = sim::serialLines().size();
+        sim::sendSerial("P10!");
+        bool done = sim::runUntil([&]{
+            const std::vector<sim::SerialLine> &lines = sim::serialLines();
+            for(; cursor + 1 < lines.size(); cursor++){
+                if(lines[cursor].text == "P10!" && lines[cursor + 1].text == "B")
+                    return true;
+            }
+            return false;
+        }, POWER_CHANGE_TIMEOUT_US);
+        TEST_ASSERT_TRUE_MESSAGE(done, "power command after random input");
+    }
+
+    void test_parser_throughput(){
+        std::vector<uint8_t> stream;
+        size_t commands = 0;
+        while(stream.size() < 1000000){
+            appendCommand(stream);
+            commands++;
+        }
+
+        Parser parser("PD", POWER_COMMAND_TIMEOUT_MS, FRAME_TIMEOUT_MS);
+        const int passes = 20;
+        size_t results = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int pass = 0; pass < passes; pass++){
+            for(uint8_t c : stream){
+                if(parser.feed(c, 0) != ParseResult::NONE)
+                    results++;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double bytes_per_s = stream.size() * passes / seconds;
+        printf("[bench] %-44s %10.0f bytes/s\n", "parser throughput", bytes_per_s);
+        printf("[bench] %-44s %10.0f commands/s\n", "parser throughput", commands * passes / seconds);
+        TEST_ASSERT_EQUAL_MESSAGE(commands * passes, results, "every command parsed");
+        TEST_ASSERT_TRUE_MESSAGE(bytes_per_s >= BUDGET_PARSER_BYTES_PER_S, "parser throughput");
+    }
+
+
+int main(){
+    sim::boot();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_parser_fuzz);
+    RUN_TEST(test_firmware_fuzz);
+    RUN_TEST(test_parser_throughput);
+    return UNITY_END();
+}
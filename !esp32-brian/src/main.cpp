@@ -1,228 +1,489 @@
 #include <Arduino.h>
+#include <esp_timer.h>
+#include <Preferences.h>
+#include <ShockerCore.h>
+#include <SpscRing.h>
+#ifdef ARDUINO_ARCH_ESP32
+    #include <driver/uart.h>
+    #include <esp_pm.h>
+    #include <esp_sleep.h>
+#endif
 
 // Config
-    #define POWER_ADJUST_ON_TIME_MS 70  // The time the button is held down when changing the power.
-    #define POWER_ADJUST_OFF_TIME_MS 10 // The gap between presses of the button.
-    #define CALIBRATION_HOLD_TIME_S 18  // The time to hold down the decrease button during first-time calibration.
-    #define POWER_COMMAND_TIMEOUT_MS 10000 // Maximum time to wait for complete power command
-
+    // Tasks
+        #define COMMS_TASK_CORE 0            // Serial reading, parsing and writing
+        #define ACTUATOR_TASK_CORE 1         // Buttons, shocker and the command queue
+        #define COMMS_TASK_STACK 4096        // Bytes
+        #define ACTUATOR_TASK_STACK 4096     // Bytes, NVS writes need the most
+        #define COMMS_TASK_PRIORITY 2
+        #define ACTUATOR_TASK_PRIORITY 3
+        #define REQUEST_QUEUE_SIZE 16        // Parsed commands on their way to the actuator task
+        #define TELEMETRY_BUFFER_SIZE 512    // Bytes of status lines and frames on their way to the serial port
+        #define ACTUATOR_IDLE_WAIT_MS 1000   // Longest sleep of the idle actuator task, msUntilDue() has the real deadline
+        #define COMMS_IDLE_WAIT_MS 20        // How often the idle comms task wakes up for the parser timeouts
+
+    // Serial
+        #define SERIAL_RX_BUFFER_BYTES 1024  // RX ring the UART driver fills from its interrupt, the host's credit (see Flow control in ShockerCore.h)
+
+    // Light sleep
+    // Off by default: the bytes that wake the board are lost, so it needs a host that sends a wake byte after a quiet
+    // spell (the server does when the banner lists uart-wake), and a framework built with tickless idle.
+        #define LIGHT_SLEEP_IDLE 0
+        #define LIGHT_SLEEP_AFTER_MS 2000    // Time without serial traffic or a running command before the board may sleep
+        #define UART_WAKEUP_THRESHOLD 3      // Rising edges on RX that wake the board, the "\n\n" the host sends has six
+
+
+// Board
+// Up to four units, each with a single 0 to 99 range, homed by holding a power button into its end stop. Serial and
+// the actuators run on separate cores.
+    struct Esp32Board {
+        static constexpr const char *NAME = "esp32";
+
+        // Pins
+        // One row per unit, leave out the rows of units that aren't wired. The ramps of all channels run at the same time.
+            static constexpr ShockerPins CHANNELS[] = {
+                // Shocker, increase power button, decrease power button, status LED
+                { 27, 25, 26, 2 }, // GPIO 2 is the onboard LED on ESP32
+                { 13, 32, 33, NO_PIN },
+                { 4, 16, 17, NO_PIN },
+                { 18, 19, 21, NO_PIN },
+            };
+
+        // Timing
+            static constexpr unsigned long POWER_ADJUST_ON_TIME_MS = 70;     // The time the button is held down when changing the power.
+            static constexpr unsigned long POWER_ADJUST_OFF_TIME_MS = 10;    // The gap between presses of the button.
+            static constexpr unsigned long POWER_COMMAND_TIMEOUT_MS = 10000; // Maximum time to wait for the rest of a P<n>! or D<ms>! command.
+
+        static constexpr bool DUAL_RANGE = false;
+
+        // Homing
+            static constexpr HomingStrategy HOMING = HomingStrategy::HOLD;
+            static constexpr unsigned long CALIBRATION_HOLD_TIME_S = 18;       // The time to hold down a power button to cross the whole range during first-time calibration.
+            static constexpr int CALIBRATION_MARGIN_STEPS = 5;                 // Steps held past the expected end stop when verifying a known power level.
+            static constexpr unsigned long CALIBRATION_RELEASE_TIME_MS = 500;  // The time the power button is released before the calibration hold.
+
+        static constexpr bool SPLIT_TASKS = true;
+
+        // Patterns, also kept in NVS
+            static constexpr uint8_t PATTERN_SLOTS = 8;
+            static constexpr uint8_t PATTERN_MAX_SIZE = 128; // Bytes per program
+            static constexpr bool PATTERN_STORAGE = true;
+
+        static constexpr bool UART_WAKE = LIGHT_SLEEP_IDLE;
+        static constexpr int SERIAL_RX_CAPACITY = SERIAL_RX_BUFFER_BYTES;
+
+        // Metrics
+        // The loop is timed with the cycle counter. The counters of the two cores don't agree, so the command to
+        // edge latency, which starts on the comms core, uses micros().
+            static constexpr uint32_t METRICS_CLOCK_PER_US = 240;
+            static uint32_t metricsClock(){
+                #ifdef ARDUINO_ARCH_ESP32
+                    return ESP.getCycleCount();
+                #else
+                    return micros() * METRICS_CLOCK_PER_US;
+                #endif
+            }
 
-// Pins
-    #define PIN_SHOCKER 27        // Pin number for the shocker
-    #define PIN_INCREASE_POWER 25 // Pin number for the increase power button
-    #define PIN_DECREASE_POWER 26 // Pin number for the decrease power button
-    #define PIN_LED 2             // Pin number for the status LED (GPIO 2 is the onboard LED on ESP32)
+        static void startPulseTimer(uint8_t channel, uint16_t length_ms);
+        static void stopPulseTimer(uint8_t channel);
+        static void startPressTimer(uint8_t channel, uint8_t first_ms);
+        static bool readStorage(uint8_t channel, void *data, size_t size);
+        static void writeStorage(uint8_t channel, const void *data, size_t size);
+        static bool readTiming(uint8_t channel, void *data, size_t size);
+        static void writeTiming(uint8_t channel, const void *data, size_t size);
+        static bool handleCommand(char command);
+        static void submit(const Command &request);
+        static bool nextRequest(Command &request);
+        static void write(const uint8_t *data, size_t length);
+        static uint8_t readPattern(uint8_t slot, uint8_t *data, size_t size);
+        static void writePattern(uint8_t slot, const uint8_t *data, uint8_t length);
+    };
 
 
 // State
-    enum class ShockerState {
-        IDLE,
-        BUSY,
-        SHOCKING,
-    };
-    ShockerState currentState = ShockerState::IDLE;
-
-    int powerLevel = 0; // Power level for the shocker
+    ShockerCore<Esp32Board> shocker;
+
+    // Timed pulse
+    // One timer per channel, the callback runs from the high priority esp_timer task, tens of us after the deadline at most.
+        esp_timer_handle_t pulseTimers[ShockerCore<Esp32Board>::CHANNEL_COUNT] = {};
+
+    // Press trains
+    // One timer per channel as well. Each edge is armed from the time the last one was due rather than when its
+    // callback ran, so the callback latency doesn't add up over a train.
+        esp_timer_handle_t pressTimers[ShockerCore<Esp32Board>::CHANNEL_COUNT] = {};
+        int64_t pressEdgeDueUs[ShockerCore<Esp32Board>::CHANNEL_COUNT] = {}; // esp_timer_get_time() of the next edge
+
+    // Stored calibration and patterns
+        Preferences calibrationStore;
+
+    // Tasks
+    // The comms task owns the serial port and the actuator task owns everything else, so a ramp or an NVS write
+    // never holds up reading the next command. The only shared state are the two rings below, each with one
+    // writer and one reader, and task notifications that wake the actuator task as soon as a request is in.
+        SpscRing<Command, REQUEST_QUEUE_SIZE> requestQueue;       // Comms task to actuator task
+        SpscRing<uint8_t, TELEMETRY_BUFFER_SIZE> telemetryQueue; // Actuator task to comms task, whole lines and frames
+
+        struct TaskStats {
+            std::atomic<uint32_t> busyUs; // Time spent working, only written by the task itself
+            uint32_t reportedBusyUs;      // busyUs at the last T command
+        };
+        TaskStats commsStats;
+        TaskStats actuatorStats;
+        unsigned long statsReportedAt = 0; // micros() of the last T command
+        unsigned long commsBusySince = 0;  // micros() when the comms task last woke up
+
+        #ifdef ARDUINO_ARCH_ESP32
+            TaskHandle_t commsTaskHandle = nullptr;
+            TaskHandle_t actuatorTaskHandle = nullptr;
+        #endif
+
+    // Light sleep
+    // The comms task holds the lock while there is serial traffic or the actuator task has something running.
+        #if LIGHT_SLEEP_IDLE && defined(ARDUINO_ARCH_ESP32)
+            esp_pm_lock_handle_t awakeLock = nullptr; // nullptr if the framework can't light sleep
+            bool isAwakeLockHeld = false;
+            unsigned long serialActiveAt = 0;         // millis() of the last byte in or out
+        #endif
+        std::atomic<bool> isActuatorIdle{true};       // Written by the actuator task after every step
 
 
 // Functions
-    // Reporting state
-        void reportStateIdle(){
-            currentState = ShockerState::IDLE;
-            Serial.print("B\n");
-        }
-        void reportStateBusy(){
-            currentState = ShockerState::BUSY;
-            Serial.print("C\n");
-        }
-        void reportStateShocking(){
-            currentState = ShockerState::SHOCKING;
-            Serial.print("A\n");
-        }
-        void reportPowerLevel(){
-            Serial.print("P");
-            Serial.print(powerLevel);
-            Serial.print("!\n");
-        }
-
-    // Pressing the buttons
-        void pressShockStart(){
-            digitalWrite(PIN_LED, HIGH);
-            digitalWrite(PIN_SHOCKER, HIGH);
-            reportStateShocking();
-        }
-        void pressShockStop(){
-            digitalWrite(PIN_LED, LOW);
-            digitalWrite(PIN_SHOCKER, LOW);
-            reportStateIdle();
-        }
-        void pressPowerInc(){
-            digitalWrite(PIN_INCREASE_POWER, HIGH);
-            delay(POWER_ADJUST_ON_TIME_MS);
-            digitalWrite(PIN_INCREASE_POWER, LOW);
-            delay(POWER_ADJUST_OFF_TIME_MS);
-
-            powerLevel++;
-            reportPowerLevel();
-        }
-        void pressPowerDec(){
-            digitalWrite(PIN_DECREASE_POWER, HIGH);
-            delay(POWER_ADJUST_ON_TIME_MS);
-            digitalWrite(PIN_DECREASE_POWER, LOW);
-            delay(POWER_ADJUST_OFF_TIME_MS);
-
-            powerLevel--;
-            reportPowerLevel();
-        }
-
-    // Processing power adjustment
-        // This fucntion decides weather to call the first time or calibrated version of the function
-        void setPowerLevelFirstTime(int set_to);
-        void setPowerLevelCalibrated(int set_to);
-        void setPowerLevel(int set_to){
-            static bool is_calibrated = false;
-
-            if(is_calibrated == false){
-                setPowerLevelFirstTime(set_to);
-                is_calibrated = true;
-            }else{
-                setPowerLevelCalibrated(set_to);
+    // Tasks
+        void wakeCommsTask(){
+            #ifdef ARDUINO_ARCH_ESP32
+                if(commsTaskHandle)
+                    xTaskNotifyGive(commsTaskHandle);
+            #endif
+        }
+        void wakeActuatorTask(){
+            #ifdef ARDUINO_ARCH_ESP32
+                if(actuatorTaskHandle)
+                    xTaskNotifyGive(actuatorTaskHandle);
+            #endif
+        }
+
+        // Writes the finished telemetry to the serial port, comms task only
+        void drainTelemetry(){
+            uint8_t buffer[64];
+            size_t length = 0;
+            while(telemetryQueue.pop(buffer[length])){
+                if(++length == sizeof(buffer)){
+                    Serial.write(buffer, length);
+                    length = 0;
+                }
+            }
+            if(length > 0){
+                Serial.write(buffer, length);
             }
         }
 
-        // This calibrates the power variable to the real one
-        void setPowerLevelFirstTime(int set_to){
-            // Ensure the shocker is stopped before changing power level
-                pressShockStop();
-                reportStateBusy();
+        // Everything the actuator task reports goes through here instead of Serial. Each call is a whole line or
+        // frame and is handed to the comms task in one piece, so the comms task never splits one with its own output.
+        void Esp32Board::write(const uint8_t *data, size_t length){
+            for(size_t i = 0; i < length; i++){
+                while(!telemetryQueue.stage(data[i])){
+                    // The comms task is behind, wait for it to make room
+                    #ifdef ARDUINO_ARCH_ESP32
+                        vTaskDelay(1);
+                    #else
+                        drainTelemetry();
+                    #endif
+                }
+            }
+            telemetryQueue.publish();
+            wakeCommsTask();
+        }
 
-            // Validate and set the power level
-                if (set_to < 0 || set_to > 99) {
-                    Serial.print("Invalid power level.\n");
-                    reportStateIdle();
-                    return;
+    // Pulse timer
+        void onPulseTimer(void *arg){
+            uint8_t channel = (uintptr_t)arg;
+            digitalWrite(Esp32Board::CHANNELS[channel].shocker, LOW);
+            shocker.channels[channel].pulseEnded = true;
+            wakeActuatorTask(); // Reports the end right away
+        }
+        void Esp32Board::startPulseTimer(uint8_t channel, uint16_t length_ms){
+            esp_timer_stop(pulseTimers[channel]);
+            esp_timer_start_once(pulseTimers[channel], length_ms * 1000ULL);
+        }
+        void Esp32Board::stopPulseTimer(uint8_t channel){
+            esp_timer_stop(pulseTimers[channel]); // Fails harmlessly when the timer isn't running
+        }
+
+    // Press timer
+        void onPressTimer(void *arg){
+            uint8_t channel = (uintptr_t)arg;
+            uint8_t next_ms = shocker.channels[channel].pressTimerEdge();
+            if(next_ms > 0){
+                pressEdgeDueUs[channel] += next_ms * 1000LL;
+                int64_t wait_us = pressEdgeDueUs[channel] - esp_timer_get_time();
+                esp_timer_start_once(pressTimers[channel], wait_us > 0 ? wait_us : 0);
+            }
+            wakeActuatorTask(); // Counts the press right away
+        }
+        void Esp32Board::startPressTimer(uint8_t channel, uint8_t first_ms){
+            esp_timer_stop(pressTimers[channel]);
+            pressEdgeDueUs[channel] = esp_timer_get_time() + first_ms * 1000LL;
+            esp_timer_start_once(pressTimers[channel], first_ms * 1000ULL);
+        }
+
+    // Stored calibration and press timing
+    // Flash writes stall the cache, the core only writes the calibration once the power has been idle for a while.
+    // Channel 0 keeps the key of the single channel firmware, so an upgrade doesn't home again.
+        // name for channel 0, name followed by the channel for the others
+        void channelKey(const char *name, uint8_t channel, char *key){
+            strcpy(key, name);
+            if(channel > 0){
+                size_t length = strlen(key);
+                key[length] = '0' + channel;
+                key[length + 1] = '\0';
+            }
+        }
+        bool Esp32Board::readStorage(uint8_t channel, void *data, size_t size){
+            char key[13];
+            channelKey("calibration", channel, key);
+            return calibrationStore.getBytes(key, data, size) == size;
+        }
+        void Esp32Board::writeStorage(uint8_t channel, const void *data, size_t size){
+            char key[13];
+            channelKey("calibration", channel, key);
+            calibrationStore.putBytes(key, data, size);
+        }
+        bool Esp32Board::readTiming(uint8_t channel, void *data, size_t size){
+            char key[8];
+            channelKey("timing", channel, key);
+            return calibrationStore.getBytes(key, data, size) == size;
+        }
+        void Esp32Board::writeTiming(uint8_t channel, const void *data, size_t size){
+            char key[8];
+            channelKey("timing", channel, key);
+            calibrationStore.putBytes(key, data, size);
+        }
+
+    // Stored patterns
+    // Written on upload, only the pattern being replaced is stopped for it.
+        void patternKey(uint8_t slot, char *key){
+            strcpy(key, "pattern0");
+            key[7] = '0' + slot;
+        }
+        uint8_t Esp32Board::readPattern(uint8_t slot, uint8_t *data, size_t size){
+            char key[9];
+            patternKey(slot, key);
+            size_t length = calibrationStore.getBytesLength(key);
+            if(length == 0 || length > size)
+                return 0;
+            return calibrationStore.getBytes(key, data, length);
+        }
+        void Esp32Board::writePattern(uint8_t slot, const uint8_t *data, uint8_t length){
+            char key[9];
+            patternKey(slot, key);
+            calibrationStore.putBytes(key, data, length);
+        }
+
+    // Actuator task
+        bool Esp32Board::nextRequest(Command &request){
+            return requestQueue.pop(request);
+        }
+
+        void actuatorTaskStep(){
+            unsigned long start_us = micros();
+            shocker.update();
+            isActuatorIdle = shocker.isIdle();
+            actuatorStats.busyUs += micros() - start_us;
+        }
+
+        #ifdef ARDUINO_ARCH_ESP32
+            // Sleeps until the running step or pattern wait is due or a request or the end of a pulse wakes it up
+            TickType_t actuatorWaitTicks(){
+                return pdMS_TO_TICKS(shocker.msUntilDue(ACTUATOR_IDLE_WAIT_MS)); // Rounded down, the last ms is polled
+            }
+
+            void actuatorTask(void *arg){
+                for(;;){
+                    actuatorTaskStep();
+                    ulTaskNotifyTake(pdTRUE, actuatorWaitTicks());
                 }
+            }
+        #endif
+
+    // Comms task
+        // Lets the actuator task run while the comms task waits for room in the request queue
+        void commsYield(){
+            drainTelemetry();
+            commsStats.busyUs += micros() - commsBusySince;
+            #ifdef ARDUINO_ARCH_ESP32
+                vTaskDelay(1);
+            #else
+                actuatorTaskStep(); // Both tasks share loop() on the host
+            #endif
+            commsBusySince = micros();
+        }
 
-            // Go to 0 power first
-                digitalWrite(PIN_DECREASE_POWER, LOW);
-                delay(500); // Small delay to ensure the pin state is settled
-                digitalWrite(PIN_DECREASE_POWER, HIGH);
-                delay(CALIBRATION_HOLD_TIME_S * 1000); // Hold down the decrease button for X seconds to ensure we are at 0
-                digitalWrite(PIN_DECREASE_POWER, LOW);
-                powerLevel = 0;
+        // Hands a parsed command to the actuator task
+        void Esp32Board::submit(const Command &request){
+            while(!requestQueue.push(request)){
+                commsYield(); // The actuator task empties the queue every step
+            }
+            wakeActuatorTask();
+        }
+
+        void reportTaskStats(const char *name, TaskStats &stats, unsigned long elapsed_us){
+            uint32_t busy_us = stats.busyUs;
+            uint32_t permille = elapsed_us > 0 ? (uint64_t)(busy_us - stats.reportedBusyUs) * 1000 / elapsed_us : 0;
+            stats.reportedBusyUs = busy_us;
+
+            Serial.print("Task ");
+            Serial.print(name);
+            Serial.print(": cpu ");
+            Serial.print(permille / 10);
+            Serial.print(".");
+            Serial.print(permille % 10);
+            Serial.print("%");
+            #ifdef ARDUINO_ARCH_ESP32
+                TaskHandle_t handle = name[0] == 'c' ? commsTaskHandle : actuatorTaskHandle;
+                Serial.print(", stack ");
+                Serial.print((unsigned long)uxTaskGetStackHighWaterMark(handle)); // Bytes on the ESP32
+                Serial.print(" bytes free");
+            #endif
+            Serial.print("\n");
+        }
+        // Prints the share of time each task spent working since the last T command, and the least free stack it ever had
+        void reportAllTaskStats(){
+            unsigned long now_us = micros();
+            unsigned long elapsed_us = now_us - statsReportedAt;
+            statsReportedAt = now_us;
+
+            drainTelemetry();
+            reportTaskStats("comms", commsStats, elapsed_us);
+            reportTaskStats("actuator", actuatorStats, elapsed_us);
+        }
 
-                setPowerLevelCalibrated(set_to);
+        // Commands only this board has
+        bool Esp32Board::handleCommand(char command){
+            switch(command){
+                case 'T':
+                    // Task CPU and stack statistics
+                    reportAllTaskStats();
+                    return true;
 
-            // Report the new power level and reset state
-                reportPowerLevel();
-                reportStateIdle();
+                default:
+                    return false;
+            }
         }
 
-        // This function assumes the power level is already calibrated
-        void setPowerLevelCalibrated(int set_to){
-            // Ensure the shocker is stopped before changing power level
-                pressShockStop();
-                reportStateBusy();
+        #if LIGHT_SLEEP_IDLE && defined(ARDUINO_ARCH_ESP32)
+            // Lets the board sleep once the serial port has been quiet for a while and nothing is running
+            void updateAwakeLock(bool had_traffic){
+                if(!awakeLock)
+                    return;
+                if(had_traffic)
+                    serialActiveAt = millis();
 
-            // Validate and the power level
-                if (set_to < 0 || set_to > 99) {
-                    Serial.print("Invalid power level.\n");
-                    reportStateIdle();
+                bool stay_awake = !isActuatorIdle || millis() - serialActiveAt < LIGHT_SLEEP_AFTER_MS;
+                if(stay_awake == isAwakeLockHeld)
                     return;
+                if(stay_awake){
+                    esp_pm_lock_acquire(awakeLock);
+                } else {
+                    esp_pm_lock_release(awakeLock);
                 }
+                isAwakeLockHeld = stay_awake;
+            }
 
-            // Adjust the power level to the desired setting
-                if(powerLevel < set_to){
-                    while(powerLevel < set_to){
-                        pressPowerInc();
-                    }
-                }else{
-                    while(powerLevel > set_to){
-                        pressPowerDec();
-                    }
+            void startLightSleep(){
+                esp_pm_config_esp32_t pm_config = {};
+                pm_config.max_freq_mhz = 240;
+                pm_config.min_freq_mhz = 240; // The loop metric counts cycles, the clock has to stay put
+                pm_config.light_sleep_enable = true;
+                if(esp_pm_configure(&pm_config) != ESP_OK){
+                    Serial.print("Light sleep is not available in this build\n");
+                    return;
                 }
-
-            // Report the new power level and reset state
-                reportPowerLevel();
-                reportStateIdle();
+                esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "awake", &awakeLock);
+                esp_pm_lock_acquire(awakeLock);
+                isAwakeLockHeld = true;
+                uart_set_wakeup_threshold(UART_NUM_0, UART_WAKEUP_THRESHOLD);
+                esp_sleep_enable_uart_wakeup(UART_NUM_0);
+            }
+        #endif
+
+        void commsTaskStep(){
+            commsBusySince = micros();
+            bool had_traffic = Serial.available() > 0 || !telemetryQueue.isEmpty();
+            drainTelemetry();
+            shocker.readSerial();
+            drainTelemetry();
+            #if LIGHT_SLEEP_IDLE && defined(ARDUINO_ARCH_ESP32)
+                updateAwakeLock(had_traffic);
+            #else
+                (void)had_traffic;
+            #endif
+            commsStats.busyUs += micros() - commsBusySince;
         }
 
+        #ifdef ARDUINO_ARCH_ESP32
+            // The UART driver calls this from its event task once bytes are in, at most two byte times after the last one
+            void onSerialReceive(){
+                wakeCommsTask();
+            }
+
+            void commsTask(void *arg){
+                for(;;){
+                    commsTaskStep();
+                    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(COMMS_IDLE_WAIT_MS)); // Woken by serial input and new telemetry
+                }
+            }
+        #endif
+
 
 // Main loop
     void setup(){
         // Serial
+            Serial.setRxBufferSize(SERIAL_RX_BUFFER_BYTES); // Before begin(), the default is 256
             Serial.begin(115200);
             while (!Serial)
                 delay(10); // Wait for serial port to connect. Needed for native USB port only
             Serial.print("\n\nSerial started!\n");
 
-        // Set pin modes
-            pinMode(PIN_LED, OUTPUT);
-            pinMode(PIN_SHOCKER, OUTPUT);
-            pinMode(PIN_INCREASE_POWER, OUTPUT);
-            pinMode(PIN_DECREASE_POWER, OUTPUT);
-            pressShockStop();
+        // Pulse and press timers
+            for(uint8_t channel = 0; channel < shocker.CHANNEL_COUNT; channel++){
+                esp_timer_create_args_t pulseTimerArgs = {};
+                pulseTimerArgs.callback = onPulseTimer;
+                pulseTimerArgs.arg = (void *)(uintptr_t)channel;
+                pulseTimerArgs.name = "pulse";
+                esp_timer_create(&pulseTimerArgs, &pulseTimers[channel]);
+
+                esp_timer_create_args_t pressTimerArgs = {};
+                pressTimerArgs.callback = onPressTimer;
+                pressTimerArgs.arg = (void *)(uintptr_t)channel;
+                pressTimerArgs.name = "press";
+                esp_timer_create(&pressTimerArgs, &pressTimers[channel]);
+            }
+
+        // Restore the power levels from before the reboot
+            calibrationStore.begin("ciab", false);
+            shocker.begin();
+
+        // Idle
+            #if LIGHT_SLEEP_IDLE && defined(ARDUINO_ARCH_ESP32)
+                startLightSleep();
+            #endif
+
+        // Tasks
+            #ifdef ARDUINO_ARCH_ESP32
+                Serial.onReceive(onSerialReceive);
+                xTaskCreatePinnedToCore(actuatorTask, "actuator", ACTUATOR_TASK_STACK, nullptr, ACTUATOR_TASK_PRIORITY, &actuatorTaskHandle, ACTUATOR_TASK_CORE);
+                xTaskCreatePinnedToCore(commsTask, "comms", COMMS_TASK_STACK, nullptr, COMMS_TASK_PRIORITY, &commsTaskHandle, COMMS_TASK_CORE);
+            #endif
+            statsReportedAt = micros();
     }
 
+    // Each task gets a core of its own. The host build has no scheduler and runs both in turn from loop().
     void loop(){
-        while(Serial.available()){
-            char pis = Serial.read();
-
-            switch(pis){
-                case '1':
-                    pressShockStart();
-                    pressShockStart();
-                    break;
-
-                case '0':
-                    pressShockStop();
-                    pressShockStop();
-                    break;
-
-                case 'P':
-                    {
-                        // Read the power level digits until we find the '!' terminator
-                        String powerStr = "";
-                        unsigned long startTime = millis();
-                        const unsigned long timeout = POWER_COMMAND_TIMEOUT_MS; // 10 second timeout
-
-                        while (millis() - startTime < timeout) {
-                            if (Serial.available()) {
-                                char nextChar = Serial.read();
-                                if (nextChar == '!') {
-                                    // Found terminator, parse the power level
-                                    int powerLevel = powerStr.toInt();
-                                    if (powerLevel >= 0 && powerLevel <= 99) {
-                                        setPowerLevel(powerLevel);
-                                    } else {
-                                        Serial.print("Invalid power level range.\n");
-                                    }
-                                    break;
-                                } else if (isDigit(nextChar)) {
-                                    powerStr += nextChar;
-                                } else {
-                                    // Invalid character in power level
-                                    Serial.print("Invalid power level format.\n");
-                                    break;
-                                }
-                            }
-                        }
-
-                        // Check for timeout
-                        if (millis() - startTime >= timeout) {
-                            Serial.print("Power level command timeout.\n");
-                        }
-                    }
-                    break;
-
-                case 'C':
-                    // Calibrate power level to 0
-                    setPowerLevelFirstTime(powerLevel);
-                    break;
-
-                default:
-                    Serial.print("Stop pressing random buttons idiot\n");
-                    break;
-            }
-        }
-    }
\ No newline at end of file
+        #ifdef ARDUINO_ARCH_ESP32
+            vTaskDelete(NULL); // setup() started the tasks, the Arduino loop task isn't needed anymore
+        #else
+            commsTaskStep();
+            actuatorTaskStep();
+            drainTelemetry();
+        #endif
+    }
@@ -0,0 +1,464 @@
+// Timing benchmarks run against src/main.cpp on the host, see lib/ArduinoSim.
+// All numbers are virtual time, a result above its budget fails the run.
+// The tests share one booted firmware and run in order, each starts from the state the previous one left.
+#include <Arduino.h>
+#include <ArduinoSim.h>
+#include <unity.h>
+#include <stdio.h>
+#include <algorithm>
+
+// Pins of channel 0 and the channel count, must match src/main.cpp
+    #define PIN_SHOCKER 27
+    #define PIN_INCREASE_POWER 25
+    #define PIN_DECREASE_POWER 26
+    #define CHANNEL_COUNT 4
+
+// Framed protocol and patterns, must match lib/ShockerCore
+    #define FRAME_START 0xA5
+    #define FRAME_SET_POWER 0x03
+    #define FRAME_SHOCK_PULSE 0x05
+    #define FRAME_ACCEPTED 0x80
+    #define FRAME_COMPLETED 0x81
+    #define FRAME_PATTERN_UPLOAD 0x06
+    #define FRAME_PATTERN_START 0x07
+    #define FRAME_STATUS_OK 0
+    #define FRAME_CHANNEL_SHIFT 4
+
+    #define PATTERN_END 0x00
+    #define PATTERN_POWER 0x01
+    #define PATTERN_POWER_RANDOM 0x02
+    #define PATTERN_PULSE 0x03
+    #define PATTERN_WAIT 0x05
+    #define PATTERN_LOOP 0x07
+    #define PATTERN_FLAG_PREPOSITION 0x01
+
+// Budgets
+    #define BUDGET_EDGE_LATENCY_US 1000UL           // Command received to pin edge
+    #define BUDGET_REPLY_LATENCY_US 1000UL          // Command received to its serial reply
+    #define BUDGET_CALIBRATION_US 18600000UL        // First P after boot
+    #define BUDGET_CALIBRATION_HIGH_US 19000000UL   // First P95 on a board with nothing stored
+    #define BUDGET_RECALIBRATION_US 18600000UL      // C command at power 99
+    #define BUDGET_VERIFY_US 2600000UL              // V command at power 95
+    #define BUDGET_FULL_RANGE_US 8000000UL          // 0 -> 99 or 99 -> 0
+    #define BUDGET_SLIDER_SETTLE_US 2100000UL       // Last command of the 20 -> 50 slider drag to the ramp being done
+    #define BUDGET_SLIDER_PRESSES 30                // Button presses for the 20 -> 50 slider drag
+    #define BUDGET_PULSE_ERROR_US 50UL              // D<ms>! pulse length against the requested length
+    #define BUDGET_STORAGE_WRITES 2UL               // NVS writes for a burst of power changes
+    #define BUDGET_REBOOT_POWER_CHANGE_US 500000UL  // 40 -> 45 after a reboot, no homing
+    #define BUDGET_PATTERN_ERROR_US 1000UL          // Pulse length and gap of a pattern against the programmed ones
+    #define BUDGET_CHANNEL_SCALING 3.5              // Power changes per second of CHANNEL_COUNT channels against one
+
+    #define POWER_CHANGE_TIMEOUT_US 60000000ULL
+    #define CALIBRATION_SAVE_DELAY_US 5000000ULL // Must match CALIBRATION_SAVE_DELAY_MS in lib/ShockerCore
+
+
+// Helpers
+    void setUp(){}
+    void tearDown(){}
+
+    void report(const char *name, uint64_t us){
+        printf("[bench] %-44s %10.3f ms\n", name, us / 1000.0);
+    }
+
+    // Runs until the "B" that follows the final P<level>! report of the channel, returns its time
+    uint64_t waitForPowerLevel(int level, size_t cursor, int channel = 0){
+        char prefix[12] = "";
+        if(channel > 0){
+            snprintf(prefix, sizeof(prefix), "%d:", channel);
+        }
+        char text[24];
+        char idle[16];
+        snprintf(text, sizeof(text), "%sP%d!", prefix, level);
+        snprintf(idle, sizeof(idle), "%sB", prefix);
+        uint64_t done = 0;
+
+        bool finished = sim::runUntil([&]{
+            const std::vector<sim::SerialLine> &lines = sim::serialLines();
+            for(; cursor + 1 < lines.size(); cursor++){
+                if(lines[cursor].text == text && lines[cursor + 1].text == idle){
+                    done = lines[cursor + 1].timeUs;
+                    return true;
+                }
+            }
+            return false;
+        }, POWER_CHANGE_TIMEOUT_US);
+
+        TEST_ASSERT_TRUE_MESSAGE(finished, text);
+        return done;
+    }
+
+    // Sends P<level>! and returns the time from its last byte until the power change is reported done
+    uint64_t timePowerChange(int level){
+        char command[8];
+        snprintf(command, sizeof(command), "P%d!", level);
+
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial(command);
+        return waitForPowerLevel(level, cursor) - sent;
+    }
+
+    // Sends a command and returns the time from its last byte to the first edge on any of the given pins
+    uint64_t timeToEdge(const char *command, const uint8_t *pins, size_t pin_count){
+        size_t cursor = sim::pinEdges().size();
+        uint64_t sent = sim::sendSerial(command);
+        uint64_t edge = 0;
+
+        bool found = sim::runUntil([&]{
+            const std::vector<sim::PinEdge> &edges = sim::pinEdges();
+            for(; cursor < edges.size(); cursor++){
+                for(size_t i = 0; i < pin_count; i++){
+                    if(edges[cursor].pin == pins[i] && edges[cursor].timeUs >= sent){
+                        edge = edges[cursor].timeUs;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }, 1000000);
+
+        TEST_ASSERT_TRUE_MESSAGE(found, command);
+        return edge - sent;
+    }
+
+    // Sends a command and returns the time from its last byte to the next serial line.
+    // Status frames of a running ramp that go out while the command is still arriving don't count.
+    uint64_t timeToReply(const char *command){
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial(command);
+        uint64_t reply = 0;
+
+        bool replied = sim::runUntil([&]{
+            const std::vector<sim::SerialLine> &lines = sim::serialLines();
+            for(; cursor < lines.size(); cursor++){
+                if(lines[cursor].timeUs >= sent){
+                    reply = lines[cursor].timeUs;
+                    return true;
+                }
+            }
+            return false;
+        }, 1000000);
+
+        TEST_ASSERT_TRUE_MESSAGE(replied, command);
+        return reply - sent;
+    }
+
+    void checkBudget(const char *name, uint64_t us, uint64_t budget){
+        report(name, us);
+        TEST_ASSERT_TRUE_MESSAGE(us <= budget, name);
+    }
+
+    // Counts the power button presses from the given pin edge index on
+    size_t countPresses(size_t from){
+        const std::vector<sim::PinEdge> &edges = sim::pinEdges();
+        size_t presses = 0;
+        for(size_t i = from; i < edges.size(); i++){
+            bool power_button = edges[i].pin == PIN_INCREASE_POWER || edges[i].pin == PIN_DECREASE_POWER;
+            if(power_button && edges[i].level == HIGH){
+                presses++;
+            }
+        }
+        return presses;
+    }
+
+
+    uint8_t frameCrc8(const uint8_t *data, size_t length){
+        uint8_t crc = 0;
+        for(size_t i = 0; i < length; i++){
+            crc ^= data[i];
+            for(uint8_t bit = 0; bit < 8; bit++){
+                crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    // Sends a command frame the way the host does, returns the time its last byte is readable
+    uint64_t sendCommandFrame(uint8_t opcode, uint8_t sequence, const uint8_t *payload, uint8_t length){
+        std::vector<uint8_t> frame = { FRAME_START, length, opcode, sequence };
+        frame.insert(frame.end(), payload, payload + length);
+        frame.push_back(frameCrc8(&frame[1], frame.size() - 1));
+        return sim::sendSerial(frame.data(), frame.size());
+    }
+
+    // Returns the first frame with the given opcode and sequence from index from on, nullptr if none
+    const sim::SerialFrame *findFrame(uint8_t opcode, uint8_t sequence, size_t from){
+        const std::vector<sim::SerialFrame> &frames = sim::serialFrames();
+        for(size_t i = from; i < frames.size(); i++){
+            if(frames[i].bytes[2] == opcode && frames[i].bytes[3] == sequence){
+                return &frames[i];
+            }
+        }
+        return nullptr;
+    }
+
+
+    // Runs until the shocker goes low again after its first rising edge at or after afterUs, returns the pulse length
+    uint64_t measurePulse(uint64_t afterUs){
+        int64_t rise = -1;
+        int64_t fall = -1;
+        bool ended = sim::runUntil([&]{
+            rise = sim::findEdge(PIN_SHOCKER, HIGH, afterUs);
+            fall = rise < 0 ? -1 : sim::findEdge(PIN_SHOCKER, LOW, rise);
+            return fall >= 0;
+        }, POWER_CHANGE_TIMEOUT_US);
+
+        TEST_ASSERT_TRUE_MESSAGE(ended, "shocker pulse");
+        return fall - rise;
+    }
+
+    uint64_t difference(uint64_t a, uint64_t b){
+        return a > b ? a - b : b - a;
+    }
+
+
+// Benchmarks
+    void test_calibration(){
+        checkBudget("calibration, first P0 after boot", timePowerChange(0), BUDGET_CALIBRATION_US);
+    }
+
+    void test_full_range(){
+        checkBudget("power change 0 -> 99", timePowerChange(99), BUDGET_FULL_RANGE_US);
+    }
+
+    void test_recalibration(){
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial("C");
+        checkBudget("recalibration, C at power 99", waitForPowerLevel(99, cursor) - sent, BUDGET_RECALIBRATION_US);
+        checkBudget("power change 99 -> 0", timePowerChange(0), BUDGET_FULL_RANGE_US);
+    }
+
+    void test_shock_latency(){
+        const uint8_t shocker[] = { PIN_SHOCKER };
+        checkBudget("start command to shocker edge", timeToEdge("1", shocker, 1), BUDGET_EDGE_LATENCY_US);
+        checkBudget("stop command to shocker edge", timeToEdge("0", shocker, 1), BUDGET_EDGE_LATENCY_US);
+    }
+
+    void test_power_latency(){
+        const uint8_t actuator[] = { PIN_INCREASE_POWER, PIN_DECREASE_POWER };
+        size_t cursor = sim::serialLines().size();
+        checkBudget("power command to first button edge", timeToEdge("P20!", actuator, 2), BUDGET_EDGE_LATENCY_US);
+        waitForPowerLevel(20, cursor);
+    }
+
+    void test_slider_burst(){
+        // Dragging the slider from 20 to 50 sends a power command every 30 ms
+        size_t cursor = sim::serialLines().size();
+        size_t edges = sim::pinEdges().size();
+        uint64_t start = sim::nowUs();
+        uint64_t sent = 0;
+        for(int level = 22; level <= 50; level += 2){
+            char command[8];
+            snprintf(command, sizeof(command), "P%d!", level);
+            sent = sim::sendSerialAt(start + (level - 22) / 2 * 30000ULL, command);
+        }
+
+        checkBudget("slider drag 20 -> 50, last command to settled", waitForPowerLevel(50, cursor) - sent, BUDGET_SLIDER_SETTLE_US);
+
+        size_t presses = countPresses(edges);
+        printf("[bench] %-44s %10u presses\n", "slider drag 20 -> 50", (unsigned)presses);
+        TEST_ASSERT_TRUE_MESSAGE(presses <= BUDGET_SLIDER_PRESSES, "slider drag presses");
+    }
+
+    void test_framed_power(){
+        size_t cursor = sim::serialLines().size();
+        size_t frames = sim::serialFrames().size();
+        uint8_t level = 30;
+        uint64_t sent = sendCommandFrame(FRAME_SET_POWER, 7, &level, 1);
+        uint64_t done = waitForPowerLevel(30, cursor);
+
+        const sim::SerialFrame *accepted = findFrame(FRAME_ACCEPTED, 7, frames);
+        const sim::SerialFrame *completed = findFrame(FRAME_COMPLETED, 7, frames);
+        TEST_ASSERT_TRUE_MESSAGE(accepted && completed, "framed power replies");
+
+        checkBudget("framed power command to accepted frame", accepted->timeUs - sent, BUDGET_REPLY_LATENCY_US);
+        checkBudget("framed power ramp done to completed frame", completed->timeUs - done, BUDGET_REPLY_LATENCY_US);
+        TEST_ASSERT_EQUAL(FRAME_STATUS_OK, completed->bytes[4]);
+        TEST_ASSERT_EQUAL(30, completed->bytes[5]);
+    }
+
+    void test_stop_during_ramp(){
+        size_t cursor = sim::serialLines().size();
+        sim::sendSerial("P99!");
+        sim::runForUs(1000000);
+        checkBudget("stop command to reply during a ramp", timeToReply("0"), BUDGET_REPLY_LATENCY_US);
+        waitForPowerLevel(99, cursor);
+        TEST_ASSERT_EQUAL(LOW, sim::pinLevel(PIN_SHOCKER));
+    }
+
+    void test_pulse_timing(){
+        uint64_t sent = sim::sendSerial("D250!");
+        checkBudget("D250! pulse length error", difference(measurePulse(sent), 250000), BUDGET_PULSE_ERROR_US);
+
+        // The timer ends the pulse, a loop() that stalls for 50 ms at a time must not stretch it
+        sim::setLoopCostUs(50000);
+        sent = sim::sendSerial("D250!");
+        checkBudget("D250! pulse length error, 50 ms loop stalls", difference(measurePulse(sent), 250000), BUDGET_PULSE_ERROR_US);
+        sim::setLoopCostUs(10);
+
+        size_t frames = sim::serialFrames().size();
+        const uint8_t length[] = { 1000 & 0xFF, 1000 >> 8 };
+        sent = sendCommandFrame(FRAME_SHOCK_PULSE, 9, length, 2);
+        checkBudget("framed 1000 ms pulse length error", difference(measurePulse(sent), 1000000), BUDGET_PULSE_ERROR_US);
+        sim::runForUs(1000);
+        const sim::SerialFrame *completed = findFrame(FRAME_COMPLETED, 9, frames);
+        TEST_ASSERT_TRUE_MESSAGE(completed, "framed pulse completed");
+        TEST_ASSERT_EQUAL(FRAME_STATUS_OK, completed->bytes[4]);
+
+        // A stop cuts the pulse short
+        sent = sim::sendSerial("D1000!");
+        sim::sendSerialAt(sent + 100000, "0");
+        TEST_ASSERT_TRUE_MESSAGE(measurePulse(sent) < 101000, "stop during a pulse");
+    }
+
+    void test_stored_calibration(){
+        // A burst of power changes is saved once, after the power has been idle for a while
+        uint64_t writes = sim::nvsWrites();
+        timePowerChange(35);
+        timePowerChange(40);
+        sim::runForUs(CALIBRATION_SAVE_DELAY_US + 1000000);
+        uint64_t written = sim::nvsWrites() - writes;
+        printf("[bench] %-44s %10u writes\n", "NVS writes, two power changes", (unsigned)written);
+        TEST_ASSERT_TRUE_MESSAGE(written <= BUDGET_STORAGE_WRITES, "storage writes");
+
+        // The next boot trusts the stored power level instead of homing again
+        sim::boot();
+        checkBudget("power change 40 -> 45 after a reboot", timePowerChange(45), BUDGET_REBOOT_POWER_CHANGE_US);
+    }
+
+    void test_homing(){
+        // A quick verify only holds the button for the distance to the nearest end stop
+        timePowerChange(95);
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial("V");
+        checkBudget("quick verify, V at power 95", waitForPowerLevel(95, cursor) - sent, BUDGET_VERIFY_US);
+
+        // A board with nothing stored homes toward the end stop closer to the target
+        sim::eraseNvs();
+        sim::boot();
+        checkBudget("calibration, first P95 on a new board", timePowerChange(95), BUDGET_CALIBRATION_HIGH_US);
+    }
+
+    void test_pattern(){
+        // Three 200 ms pulses 300 ms apart at a random power, the ramps run during the gaps
+        const uint8_t upload[] = {
+            0, // Slot
+            PATTERN_POWER, 10,
+            PATTERN_PULSE, 200, 0,
+            PATTERN_WAIT, 30, 0,
+            PATTERN_POWER_RANDOM, 10, 13,
+            PATTERN_LOOP, 2, 3,
+            PATTERN_END,
+        };
+        size_t frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_PATTERN_UPLOAD, 20, upload, sizeof(upload));
+        const uint8_t start[] = { 0, 0x34, 0x12, PATTERN_FLAG_PREPOSITION };
+        uint64_t sent = sendCommandFrame(FRAME_PATTERN_START, 21, start, sizeof(start));
+
+        bool done = sim::runUntil([&]{ return findFrame(FRAME_COMPLETED, 21, frames) != nullptr; }, POWER_CHANGE_TIMEOUT_US);
+        TEST_ASSERT_TRUE_MESSAGE(done, "pattern completed");
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_COMPLETED, 20, frames), "pattern uploaded");
+
+        std::vector<uint64_t> rises;
+        std::vector<uint64_t> falls;
+        for(const sim::PinEdge &edge : sim::pinEdges()){
+            if(edge.pin == PIN_SHOCKER && edge.timeUs >= sent){
+                (edge.level == HIGH ? rises : falls).push_back(edge.timeUs);
+            }
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(3, rises.size(), "pattern pulses");
+        TEST_ASSERT_EQUAL(3, falls.size());
+
+        uint64_t error = 0;
+        for(size_t i = 0; i < rises.size(); i++){
+            error = std::max(error, difference(falls[i] - rises[i], 200000));
+            if(i > 0){
+                error = std::max(error, difference(rises[i] - falls[i - 1], 300000));
+            }
+        }
+        checkBudget("pattern pulse and gap error", error, BUDGET_PATTERN_ERROR_US);
+
+        // The pattern is still there after a reboot
+        sim::boot();
+        frames = sim::serialFrames().size();
+        sendCommandFrame(FRAME_PATTERN_START, 22, start, sizeof(start));
+        sim::runForUs(100000);
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_ACCEPTED, 22, frames), "stored pattern started");
+        sim::sendSerial("0");
+        sim::runForUs(1000);
+        TEST_ASSERT_TRUE_MESSAGE(findFrame(FRAME_COMPLETED, 22, frames), "stop ends the pattern");
+        TEST_ASSERT_EQUAL(LOW, sim::pinLevel(PIN_SHOCKER));
+    }
+
+    void test_channels(){
+        // The new channels home at the same time, in about the time one takes
+        size_t cursor = sim::serialLines().size();
+        uint64_t sent = sim::sendSerial("P0!U1!P0!U2!P0!U3!P0!U0!");
+        uint64_t done = 0;
+        for(int channel = 0; channel < CHANNEL_COUNT; channel++){
+            done = std::max(done, waitForPowerLevel(0, cursor, channel));
+        }
+        checkBudget("calibration, all channels at once", done - sent, BUDGET_CALIBRATION_US);
+
+        // The same 20 step ramp on 1, 2 and 4 channels at once, sent as channel addressed frames
+        int levels[CHANNEL_COUNT] = {};
+        uint8_t sequence = 30;
+        double single_rate = 0;
+        double rate = 0;
+        for(int count = 1; count <= CHANNEL_COUNT; count *= 2){
+            size_t frames = sim::serialFrames().size();
+            uint64_t start = sim::nowUs();
+            uint8_t first = sequence;
+            for(int channel = 0; channel < count; channel++){
+                levels[channel] += 20;
+                uint8_t level = levels[channel];
+                sendCommandFrame(FRAME_SET_POWER | channel << FRAME_CHANNEL_SHIFT, sequence++, &level, 1);
+            }
+
+            bool finished = sim::runUntil([&]{
+                for(uint8_t s = first; s != sequence; s++){
+                    if(!findFrame(FRAME_COMPLETED, s, frames))
+                        return false;
+                }
+                return true;
+            }, POWER_CHANGE_TIMEOUT_US);
+            TEST_ASSERT_TRUE_MESSAGE(finished, "channel power changes completed");
+
+            done = 0;
+            for(int channel = 0; channel < count; channel++){
+                const sim::SerialFrame *completed = findFrame(FRAME_COMPLETED, first + channel, frames);
+                TEST_ASSERT_EQUAL(FRAME_STATUS_OK, completed->bytes[4]);
+                TEST_ASSERT_EQUAL(levels[channel], completed->bytes[5]);
+                done = std::max(done, completed->timeUs);
+            }
+            rate = count / ((done - start) / 1000000.0);
+            if(count == 1){
+                single_rate = rate;
+            }
+
+            char name[48];
+            snprintf(name, sizeof(name), "power changes, %d channel%s at once", count, count > 1 ? "s" : "");
+            printf("[bench] %-44s %10.3f changes/s\n", name, rate);
+        }
+        TEST_ASSERT_TRUE_MESSAGE(rate >= single_rate * BUDGET_CHANNEL_SCALING, "channel scaling");
+    }
+
+
+int main(){
+    sim::boot();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_calibration);
+    RUN_TEST(test_full_range);
+    RUN_TEST(test_recalibration);
+    RUN_TEST(test_shock_latency);
+    RUN_TEST(test_power_latency);
+    RUN_TEST(test_slider_burst);
+    RUN_TEST(test_framed_power);
+    RUN_TEST(test_stop_during_ramp);
+    RUN_TEST(test_pulse_timing);
+    RUN_TEST(test_stored_calibration);
+    RUN_TEST(test_homing);
+    RUN_TEST(test_pattern);
+    RUN_TEST(test_channels);
+    return UNITY_END();
+}
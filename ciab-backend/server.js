@@ -12,9 +12,15 @@ const path = require('path');
 // Configuration
     const PORT = 3000;
     const commonPatterns = ['/dev/ttyACM0', '/dev/ttyACM1', '/dev/ttyUSB0', '/dev/ttyUSB1'];
-
-    // Function to read device port from config.txt
-    function getConfiguredDevice() {
+    const MCU_METRICS_INTERVAL_MS = 60000; // How often the firmware's timing histograms are logged and cleared
+    const MCU_READY_TIMEOUT_MS = 3000;     // Longest wait for the firmware to say it is up after the port opens
+    const MCU_RECONNECT_INTERVAL_MS = 5000; // Wait between reconnect attempts after the board went away
+    const MCU_FIRMWARE_MAJOR = 1;          // Firmware protocol version this server speaks
+    const MCU_WAKE_QUIET_MS = 1000;        // Quiet time after which a board with uart-wake may be asleep
+    const MCU_WAKE_TIME_MS = 5;            // Time it needs to wake up before it reads again
+
+    // Function to read a `key = value` setting from config.txt, null if it isn't set
+    function getConfigValue(key) {
         try {
             const configPath = path.join(__dirname, '..', 'config.txt');
             const configContent = fs.readFileSync(configPath, 'utf-8');
@@ -22,12 +28,10 @@ const path = require('path');
             
             for (const line of lines) {
                 const trimmedLine = line.trim();
-                if (trimmedLine.startsWith('device')) {
+                if (trimmedLine.startsWith(key)) {
                     const parts = trimmedLine.split('=');
-                    if (parts.length === 2) {
-                        const device = parts[1].trim();
-                        console.log(`Found configured device in config.txt: ${device}`);
-                        return device;
+                    if (parts.length === 2 && parts[0].trim() === key) {
+                        return parts[1].trim();
                     }
                 }
             }
@@ -37,6 +41,15 @@ const path = require('path');
         return null;
     }
 
+    // Function to read device port from config.txt
+    function getConfiguredDevice() {
+        const device = getConfigValue('device');
+        if (device) {
+            console.log(`Found configured device in config.txt: ${device}`);
+        }
+        return device;
+    }
+
 
 // Middleware setup
     const app = express();
@@ -48,6 +61,7 @@ const path = require('path');
     let serialPort = null;
     let currentMcuStatus = 'disconnected'; // 'disconnected', 'idle', 'busy', 'running'
     let currentMcuPowerLevel = 0; // range from 0 to 99
+    const mcuChannels = new Map(); // Channel number -> { status, power_level } of the other units on a multi-channel board
 
     // Track user commands by IP
     const userCommands = {
@@ -100,8 +114,466 @@ const path = require('path');
         }
     }
 
+    // Handling data from the MCU
+        // Framed protocol, see the firmware for the frame layout. Used where we need to know when a command is done.
+        // The opcodes below address channel 0, the only one this server drives.
+        const FRAME_START = 0xA5;
+        const FRAME_OPCODES = {
+            shockStart: 0x01,
+            shockStop: 0x02,
+            setPower: 0x03,  // Payload: power level
+            calibrate: 0x04, // ESP32 only
+            shockPulse: 0x05, // Payload: length in ms, low byte first
+            patternUpload: 0x06, // Payload: slot, program
+            patternStart: 0x07,  // Payload: slot, seed (low byte first), flags
+            metrics: 0x08,       // Answered with metricsReport only
+            metricsReset: 0x09,
+            snapshot: 0x0A,      // Answered with snapshotReport only
+            accepted: 0x80,
+            completed: 0x81, // Payload: status, power level
+            rejected: 0x82,  // Payload: status
+            metricsReport: 0x83, // Payload: three histograms and the RX overflow count, see logMcuMetrics()
+            snapshotReport: 0x84, // Payload: version, state, power per range and more, see applyMcuSnapshot()
+            credit: 0x86,         // Payload: bytes the board has read (16 bit), see handleMcuCredit()
+        };
+        const FRAME_STATUSES = ['ok', 'superseded', 'cancelled', 'invalid', 'bad_crc', 'queue_full', 'unknown_opcode', 'unknown_channel'];
+
+        let mcuRxLine = '';     // Text line being received
+        let mcuRxFrame = null;  // Bytes of the frame being received, null between frames
+        let nextFrameSequence = 0;
+        const pendingFrames = new Map(); // Sequence -> { resolve, reject, timer, completeTimeoutMs }
+
+        function crc8(bytes) {
+            let crc = 0;
+            for (const byte of bytes) {
+                crc ^= byte;
+                for (let bit = 0; bit < 8; bit++) {
+                    crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) & 0xFF : (crc << 1) & 0xFF;
+                }
+            }
+            return crc;
+        }
+
+        // Splits the byte stream into text lines and frames
+        function handleMcuData(data) {
+            mcuSerialActiveAt = Date.now();
+            for (const byte of data) {
+                if (mcuRxFrame) {
+                    mcuRxFrame.push(byte);
+                    if (mcuRxFrame.length > 1 && mcuRxFrame.length === 5 + mcuRxFrame[1]) {
+                        handleMcuFrame(mcuRxFrame);
+                        mcuRxFrame = null;
+                    }
+                } else if (byte === FRAME_START && mcuRxLine === '') {
+                    mcuRxFrame = [byte];
+                } else if (byte === 0x0A) {
+                    handleMcuLine(mcuRxLine.trim());
+                    mcuRxLine = '';
+                } else {
+                    mcuRxLine += String.fromCharCode(byte);
+                }
+            }
+        }
+
+        // The MCU sends its power and state together in status frames, only changes are broadcast to the clients
+        function setMcuStatus(status, label) {
+            if (currentMcuStatus === status) return;
+            currentMcuStatus = status;
+            wsBroadcastMcuStatus();
+            console.log(`MCU is ${label}`);
+        }
+
+        // The other channels of a multi-channel board are only shown, their lines start with "<channel>:"
+        const MCU_STATUS_LETTERS = { A: 'running', B: 'idle', C: 'busy' };
+        function handleMcuChannelLine(channel, message) {
+            const state = mcuChannels.get(channel) || { status: 'idle', power_level: null };
+            if (MCU_STATUS_LETTERS[message]) {
+                if (state.status === MCU_STATUS_LETTERS[message]) return;
+                state.status = MCU_STATUS_LETTERS[message];
+            } else if (message.startsWith('P') && message.endsWith('!')) {
+                const powerLevel = parseInt(message.slice(1, -1), 10);
+                if (isNaN(powerLevel) || state.power_level === powerLevel) return;
+                state.power_level = powerLevel;
+            } else {
+                return;
+            }
+            mcuChannels.set(channel, state);
+            wsBroadcastMcuStatus();
+        }
+
+        // Error lines, "E<code>" followed by the command letter for the number errors (see Errors in ShockerCore.h)
+        const MCU_ERRORS = {
+            1: 'unknown command',
+            2: 'power level out of range',
+            3: 'pulse time out of range',
+            4: 'no such pattern slot',
+            5: 'no such channel',
+            6: 'invalid number',
+            7: 'timeout reading number',
+            8: 'frame too long',
+            9: 'frame timeout',
+            10: 'command queue full',
+            11: 'pattern slot is empty',
+        };
+
+        function handleMcuLine(message) {
+            if (!message) return;
+
+            const error = /^E(\d+)([A-Z]?)$/.exec(message);
+            if (error) {
+                const command = error[2] ? ` for ${error[2]}` : '';
+                console.error(`MCU error: ${MCU_ERRORS[error[1]] || `code ${error[1]}`}${command}`);
+                return;
+            }
+
+            if (message.startsWith('Ready ciab-shocker ')) {
+                handleMcuBanner(message);
+                return;
+            }
+
+            const channelLine = /^(\d):(.+)$/.exec(message);
+            if (channelLine) {
+                handleMcuChannelLine(parseInt(channelLine[1], 10), channelLine[2]);
+                return;
+            }
+
+            if (message === 'A') {
+                setMcuStatus('running', 'RUNNING');
+            } else if (message === 'B') {
+                setMcuStatus('idle', 'IDLE');
+            } else if (message === 'C') {
+                setMcuStatus('busy', 'BUSY');
+            } else if (message.startsWith('P') && message.endsWith('!')) {
+                const powerLevelStr = message.slice(1, -1); // Remove 'P' and '!'
+                const powerLevel = parseInt(powerLevelStr, 10);
+                if (!isNaN(powerLevel) && powerLevel >= 0 && powerLevel <= 99) {
+                    if (currentMcuPowerLevel === powerLevel) return;
+                    currentMcuPowerLevel = powerLevel;
+                    // console.log(`MCU power level set to ${currentMcuPowerLevel}`);
+                    wsBroadcastMcuStatus();
+                } else {
+                    console.error(`Invalid power level received: ${message}`);
+                }
+            }
+        }
+
+        function handleMcuFrame(frame) {
+            const length = frame[1];
+            if (crc8(frame.slice(1, 4 + length)) !== frame[4 + length]) {
+                console.error('Dropped MCU frame with bad CRC');
+                return;
+            }
+
+            const opcode = frame[2];
+            const sequence = frame[3];
+            if (opcode === FRAME_OPCODES.credit) {
+                handleMcuCredit(frame[4] | (frame[5] << 8));
+                return;
+            }
+            const pending = pendingFrames.get(sequence);
+            if (!pending) return;
+
+            if (opcode === FRAME_OPCODES.accepted) {
+                // Accepted, now wait for it to complete
+                clearTimeout(pending.timer);
+                pending.timer = setTimeout(() => {
+                    pendingFrames.delete(sequence);
+                    pending.reject(new Error('MCU did not complete the command'));
+                }, pending.completeTimeoutMs);
+            } else if (opcode === FRAME_OPCODES.completed) {
+                clearTimeout(pending.timer);
+                pendingFrames.delete(sequence);
+                pending.resolve({ status: FRAME_STATUSES[frame[4]] || frame[4], powerLevel: frame[5] });
+            } else if (opcode === FRAME_OPCODES.metricsReport || opcode === FRAME_OPCODES.snapshotReport) {
+                clearTimeout(pending.timer);
+                pendingFrames.delete(sequence);
+                pending.resolve({ payload: frame.slice(4, 4 + length), sentThrough: pending.sentThrough });
+            } else if (opcode === FRAME_OPCODES.rejected) {
+                clearTimeout(pending.timer);
+                pendingFrames.delete(sequence);
+                const status = FRAME_STATUSES[frame[4]] || frame[4];
+                pending.reject(Object.assign(new Error(`MCU rejected the command: ${status}`), { status }));
+            }
+        }
+
+        // Sends a framed command, resolves with { status, powerLevel } once the MCU reports it completed.
+        // Rejects when it is not accepted in time (e.g. firmware without the framed protocol), rejected or never completed.
+        function sendMcuFrame(opcode, payload = [], { acceptTimeoutMs = 1000, completeTimeoutMs = 60000 } = {}) {
+            return new Promise((resolve, reject) => {
+                // A running pattern keeps its sequence for as long as it runs, skip the ones still waiting for a reply
+                let sequence = nextFrameSequence;
+                while (pendingFrames.has(sequence)) {
+                    sequence = (sequence + 1) & 0xFF;
+                    if (sequence === nextFrameSequence) {
+                        reject(new Error('No free frame sequence, 256 frames are waiting for a reply'));
+                        return;
+                    }
+                }
+                nextFrameSequence = (sequence + 1) & 0xFF;
+
+                const body = [payload.length, opcode, sequence, ...payload];
+                const frame = Buffer.from([FRAME_START, ...body, crc8(body)]);
+
+                const timer = setTimeout(() => {
+                    pendingFrames.delete(sequence);
+                    reject(new Error('MCU did not accept the command'));
+                }, acceptTimeoutMs);
+                const pending = { resolve, reject, timer, completeTimeoutMs };
+                pendingFrames.set(sequence, pending);
+
+                pending.sentThrough = writeToMcu(frame);
+            });
+        }
+
+        // Firmware timing histograms. Each has 16 counts, bucket i holds the values below 2^i and the last one everything above.
+        const METRICS_BUCKETS = 16;
+        const MCU_METRICS_MAX_FAILURES = 3; // Polls in a row without an answer before the firmware is taken to have none
+        let mcuMetricsSupported = true; // Cleared when the firmware was built without them or is older
+        let mcuMetricsFailures = 0;     // Polls in a row that got no report, a busy link can lose one
+
+        function describeHistogram(counts, unit) {
+            const total = counts.reduce((sum, count) => sum + count, 0);
+            if (total === 0) return 'none';
+
+            const bound = (fraction) => {
+                let seen = 0;
+                for (let i = 0; i < counts.length; i++) {
+                    seen += counts[i];
+                    if (seen >= total * fraction) {
+                        return i === counts.length - 1 ? `>=${2 ** (i - 1)}${unit}` : `<${2 ** i}${unit}`;
+                    }
+                }
+            };
+            return `p50 ${bound(0.5)} p99 ${bound(0.99)} max ${bound(1)}`;
+        }
+
+        async function logMcuMetrics() {
+            if (!serialPort || !serialPort.isOpen || !mcuMetricsSupported) return;
+
+            try {
+                const { payload } = await sendMcuFrame(FRAME_OPCODES.metrics);
+                const word = (offset) => payload[offset] | (payload[offset + 1] << 8);
+                const histogram = (index) => Array.from({ length: METRICS_BUCKETS }, (_, i) => word((index * METRICS_BUCKETS + i) * 2));
+                const rxOverflows = word(3 * METRICS_BUCKETS * 2);
+
+                console.log(`MCU metrics: command to edge ${describeHistogram(histogram(0), 'us')}, ramp ${describeHistogram(histogram(1), 'ms')}, ` +
+                    `loop ${describeHistogram(histogram(2), 'us')}, RX overflows ${rxOverflows}`);
+                await sendMcuFrame(FRAME_OPCODES.metricsReset);
+                mcuMetricsFailures = 0;
+            } catch (error) {
+                mcuMetricsFailures++;
+                if (error.status === 'unknown_opcode' || mcuMetricsFailures >= MCU_METRICS_MAX_FAILURES) {
+                    mcuMetricsSupported = false;
+                    console.log(`MCU metrics not available: ${error.message}`);
+                } else {
+                    console.log(`MCU metrics failed, trying again in ${MCU_METRICS_INTERVAL_MS / 1000} s: ${error.message}`);
+                }
+            }
+        }
+
+        // Handshake. A board that resets when the port opens sends a ready banner once it has booted, one that doesn't
+        // answers the snapshot request sent on open. Either way we know it takes commands and what state it is in.
+        let mcuReadyWaiters = []; // Resolvers of waitForMcuReady()
+
+        function settleMcuReady(ready) {
+            mcuReadyWaiters.forEach((resolve) => resolve(ready));
+            mcuReadyWaiters = [];
+        }
+
+        // Resolves true once the firmware is known to be up, false if the port closes or timeoutMs passes first
+        function waitForMcuReady(timeoutMs) {
+            return new Promise((resolve) => {
+                const done = (ready) => {
+                    clearTimeout(timer);
+                    resolve(ready);
+                };
+                const timer = setTimeout(() => {
+                    mcuReadyWaiters = mcuReadyWaiters.filter((waiter) => waiter !== done);
+                    resolve(false);
+                }, timeoutMs);
+                mcuReadyWaiters.push(done);
+            });
+        }
+
+        // Ready ciab-shocker <major>.<minor> board=<name> channels=<n> ranges=<n> patterns=<n> caps=<list>
+        function handleMcuBanner(message) {
+            stopMcuFlowControl(); // The board's count started over, the snapshot below lines ours up again
+            const [, , version, ...fields] = message.split(' ');
+            const info = Object.fromEntries(fields.map((field) => field.split('=')));
+            mcuWakesOnUart = (info.caps || '').split(',').includes('uart-wake');
+            console.log(`MCU ready: firmware ${version} on ${info.board}, ${info.channels} channel(s), caps ${info.caps}`);
+            if (parseInt(version, 10) !== MCU_FIRMWARE_MAJOR) {
+                console.error(`MCU firmware ${version} is not compatible with this server (expects ${MCU_FIRMWARE_MAJOR}.x)`);
+            }
+            settleMcuReady(true);
+            requestMcuSnapshot().catch((error) => console.error(`MCU snapshot failed: ${error.message}`));
+        }
+
+        // Version major, minor, channel count, state, flags, uptime (4 bytes), range, range count, then power level
+        // and homed flag of each range, press timing (2 bytes), credit and bytes read (16 bit each)
+        const MCU_SNAPSHOT_STATES = ['idle', 'busy', 'running'];
+        function applyMcuSnapshot(payload, sentThrough) {
+            const credit = 11 + 2 * payload[10] + 2;
+            if (payload.length >= credit + 4) {
+                startMcuFlowControl(payload[credit] | (payload[credit + 1] << 8), payload[credit + 2] | (payload[credit + 3] << 8), sentThrough);
+            }
+
+            const range = payload[9];
+            const powerLevel = payload[11 + 2 * range];
+            const calibrated = payload[12 + 2 * range] === 1;
+            const uptimeMs = (payload[5] | (payload[6] << 8) | (payload[7] << 16)) + payload[8] * 2 ** 24;
+
+            currentMcuStatus = MCU_SNAPSHOT_STATES[payload[3]] || currentMcuStatus;
+            if (calibrated) {
+                currentMcuPowerLevel = powerLevel;
+            }
+            console.log(`MCU snapshot: ${currentMcuStatus}, power ${calibrated ? powerLevel : 'not homed yet'}, up for ${Math.round(uptimeMs / 1000)} s`);
+            wsBroadcastMcuStatus();
+        }
+
+        async function requestMcuSnapshot() {
+            const { payload, sentThrough } = await sendMcuFrame(FRAME_OPCODES.snapshot);
+            applyMcuSnapshot(payload, sentThrough);
+        }
+
+        // A board that lists uart-wake in its banner sleeps when the serial port is quiet and loses the bytes that wake
+        // it up. After a quiet spell the first write goes out behind two '\n', which an awake board ignores, and the
+        // writes are held back until the board is up.
+        let mcuWakesOnUart = false;
+        let mcuSerialActiveAt = 0;  // Date.now() of the last byte in or out
+        let mcuWakeQueue = null;    // Writes held back while the board wakes up, null when not waking it
+        // Flow control, see Flow control in ShockerCore.h. Once a snapshot has told us the board's credit and how many
+        // bytes it had read by then, writes wait for credit instead of overflowing its RX buffer. The wake bytes aren't
+        // counted, the board doesn't count them either.
+        let mcuCredit = null;       // Bytes we may have on their way to the board, null writes straight through
+        let mcuBytesQueued = 0;     // Bytes handed to writeToMcu() since the port opened
+        let mcuBytesWritten = 0;    // Of those, the bytes written to the port
+        let mcuCountOffset = 0;     // Board's count less ours, 16 bit
+        let mcuBytesRead = 0;       // Board's count in its last credit report
+        let mcuCreditQueue = [];    // Buffers waiting for credit
+        let mcuCapture = null;      // Stream of the capture file while a port is open, see writeMcuPort()
+        let mcuCaptureStartedAt = 0; // Date.now() when the port opened, the time base of the capture
+
+        // Returns the count of bytes handed over up to the end of data, see Flow control
+        function writeToMcu(data) {
+            data = Buffer.from(data);
+            mcuBytesQueued += data.length;
+            if (mcuWakeQueue) {
+                mcuWakeQueue.push(data);
+                return mcuBytesQueued;
+            }
+            if (mcuWakesOnUart && Date.now() - mcuSerialActiveAt >= MCU_WAKE_QUIET_MS) {
+                writeMcuPort('\n\n');
+                mcuWakeQueue = [data];
+                setTimeout(() => {
+                    const queued = mcuWakeQueue;
+                    mcuWakeQueue = null;
+                    mcuSerialActiveAt = Date.now();
+                    if (serialPort && serialPort.isOpen) {
+                        queued.forEach((item) => writeWithCredit(item));
+                    }
+                }, MCU_WAKE_TIME_MS);
+                return mcuBytesQueued;
+            }
+            mcuSerialActiveAt = Date.now();
+            writeWithCredit(data);
+            return mcuBytesQueued;
+        }
+
+        function startMcuFlowControl(credit, read, sentThrough) {
+            mcuCredit = credit;
+            mcuBytesRead = read;
+            mcuCountOffset = (read - sentThrough) & 0xFFFF;
+            flushMcuCreditQueue();
+        }
+        function stopMcuFlowControl() {
+            mcuCredit = null;
+            flushMcuCreditQueue();
+        }
+        function handleMcuCredit(read) {
+            mcuBytesRead = read;
+            flushMcuCreditQueue();
+        }
+
+        // Bytes the board hasn't read yet, 0 if its count got ahead of ours
+        function mcuBytesInFlight() {
+            const inFlight = (mcuBytesWritten + mcuCountOffset - mcuBytesRead) & 0xFFFF;
+            return inFlight >= 0x8000 ? 0 : inFlight;
+        }
+        function writeWithCredit(data) {
+            mcuCreditQueue.push(data);
+            flushMcuCreditQueue();
+        }
+        function flushMcuCreditQueue() {
+            while (mcuCreditQueue.length > 0 && serialPort && serialPort.isOpen) {
+                const room = mcuCredit === null ? Infinity : mcuCredit - mcuBytesInFlight();
+                if (room <= 0) return;
+
+                const data = mcuCreditQueue[0];
+                const chunk = data.length <= room ? mcuCreditQueue.shift() : data.subarray(0, room);
+                if (chunk !== data) mcuCreditQueue[0] = data.subarray(room);
+                mcuBytesWritten += chunk.length;
+                writeMcuPort(chunk);
+            }
+        }
+
+        // With `capture = <file>` in config.txt, everything sent to the board is also written to that file as
+        // "@<ms since the port opened> <bytes in hex>" lines. The file starts over on every connection. The firmware's
+        // native runner replays it (`program < capture.log`), see Recorder in lib/ShockerCore.
+        function startMcuCapture(portPath) {
+            const file = getConfigValue('capture');
+            if (!file) return;
+            mcuCapture = fs.createWriteStream(path.resolve(__dirname, '..', file));
+            mcuCaptureStartedAt = Date.now();
+            mcuCapture.write(`# ${portPath} opened ${new Date().toISOString()}\n`);
+        }
+        function stopMcuCapture() {
+            if (!mcuCapture) return;
+            mcuCapture.end();
+            mcuCapture = null;
+        }
+        function writeMcuPort(data) {
+            if (mcuCapture) {
+                mcuCapture.write(`@${Date.now() - mcuCaptureStartedAt} ${Buffer.from(data).toString('hex')}\n`);
+            }
+            serialPort.write(data);
+        }
+
+        function rejectPendingFrames(reason) {
+            pendingFrames.forEach((pending) => {
+                clearTimeout(pending.timer);
+                pending.reject(new Error(reason));
+            });
+            pendingFrames.clear();
+        }
+
+    // Keeps trying until a board is back after the port closed
+    let mcuReconnectTimer = null;
+    function scheduleMcuReconnect() {
+        if (mcuReconnectTimer) return;
+        mcuReconnectTimer = setTimeout(async () => {
+            mcuReconnectTimer = null;
+            if (serialPort && serialPort.isOpen) return;
+            await tryConnectToMcu();
+            if (!serialPort || !serialPort.isOpen) {
+                scheduleMcuReconnect();
+            }
+        }, MCU_RECONNECT_INTERVAL_MS);
+    }
+
     // Function to connect to Arduino
+    let mcuConnecting = false; // Set while tryConnectToMcu() runs, the reconnect timer and the endpoint can overlap
     async function tryConnectToMcu() {
+        if (mcuConnecting) return;
+        mcuConnecting = true;
+        try {
+            await connectToMcu();
+        } finally {
+            mcuConnecting = false;
+        }
+    }
+
+    async function connectToMcu() {
         // First scan and list only USB/ACM ports
         const availableUsbAcmPorts = await scanAndListPorts();
 
@@ -135,6 +607,8 @@ const path = require('path');
 
             try {
                 console.log(`Attempting connection to ${portPath}...`);
+                mcuRxLine = '';
+                mcuRxFrame = null;
 
                 serialPort = new SerialPort({
                     path: portPath,
@@ -144,60 +618,45 @@ const path = require('path');
                 // Set up event handlers
                 serialPort.on('open', () => {
                     console.log(`✅ Connected to Arduino on ${portPath}`);
+                    mcuMetricsSupported = true;
+                    mcuMetricsFailures = 0;
+                    mcuWakesOnUart = false;
+                    mcuWakeQueue = null;
+                    mcuCredit = null;
+                    mcuBytesQueued = 0;
+                    mcuBytesWritten = 0;
+                    mcuCreditQueue = [];
+                    startMcuCapture(portPath);
                     currentMcuStatus = 'idle';
                     wsBroadcastMcuStatus();
+                    requestMcuSnapshot().then(() => settleMcuReady(true), () => {});
                 });
 
-                serialPort.on('data', (data) => {
-                    // Handle multiple messages in one chunk (split by newline)
-                    const messages = data.toString().split('\n');
-                    messages.forEach((rawMsg) => {
-                        const message = rawMsg.trim();
-                        if (!message) return;
-
-                        if (message === 'A') {
-                            currentMcuStatus = 'running';
-                            wsBroadcastMcuStatus();
-                            console.log('MCU is RUNNING');
-                        } else if (message === 'B') {
-                            currentMcuStatus = 'idle';
-                            wsBroadcastMcuStatus();
-                            console.log('MCU is IDLE');
-                        } else if (message === 'C') {
-                            currentMcuStatus = 'busy';
-                            wsBroadcastMcuStatus();
-                            console.log('MCU is BUSY');
-                        } else if (message.startsWith('P') && message.endsWith('!')) {
-                            const powerLevelStr = message.slice(1, -1); // Remove 'P' and '!'
-                            const powerLevel = parseInt(powerLevelStr, 10);
-                            if (!isNaN(powerLevel) && powerLevel >= 0 && powerLevel <= 99) {
-                                currentMcuPowerLevel = powerLevel;
-                                // console.log(`MCU power level set to ${currentMcuPowerLevel}`);
-                                wsBroadcastMcuStatus();
-                            } else {
-                                console.error(`Invalid power level received: ${message}`);
-                            }
-                        }
-                    });
-                });
+                serialPort.on('data', handleMcuData);
 
                 serialPort.on('error', (err) => {
                     console.error(`❌ Serial port error: ${err.message}`);
+                    settleMcuReady(false);
                     currentMcuStatus = 'disconnected';
                     wsBroadcastMcuStatus();
                 });
 
                 serialPort.on('close', () => {
                     console.log('Serial port closed');
+                    rejectPendingFrames('Serial port closed');
+                    stopMcuCapture();
+                    settleMcuReady(false);
+                    mcuChannels.clear();
                     currentMcuStatus = 'disconnected';
                     wsBroadcastMcuStatus();
+                    scheduleMcuReconnect();
                 });
 
-                // Wait a moment for the connection to establish
-                await new Promise(resolve => setTimeout(resolve, 1000));
+                // Wait for the banner or the snapshot, firmware older than both only gets the timeout
+                const ready = await waitForMcuReady(MCU_READY_TIMEOUT_MS);
 
                 if (serialPort.isOpen) {
-                    console.log(`✅ Successfully connected to ${portPath}`);
+                    console.log(`✅ Successfully connected to ${portPath}${ready ? '' : ', firmware did not report ready'}`);
                     return; // Successfully connected, exit function
                 }
             } catch (error) {
@@ -290,7 +749,7 @@ const path = require('path');
             active: randomShockingActive,
             settings: randomShockSettings,
             mcu_connected: serialPort && serialPort.isOpen,
-            next_shock_scheduled: randomShockTimeout !== null
+            next_shock_scheduled: randomShockTimeout !== null || randomPatternRunning
         });
     });
 
@@ -324,6 +783,7 @@ const path = require('path');
         }
 
         // Validate and update other settings
+        const rangesChanged = Boolean(gapRange || durationRange || powerRange);
         if (gapRange && gapRange.min && gapRange.max) {
             if (gapRange.min >= 1000 && gapRange.max >= gapRange.min && gapRange.max <= 300000) {
                 randomShockSettings.gapRange = gapRange;
@@ -348,12 +808,17 @@ const path = require('path');
             }
         }
 
+        // A pattern on the MCU has the ranges built in, send it again
+        if (rangesChanged && randomShockingActive && randomPatternMode) {
+            startRandomPattern();
+        }
+
         console.log(`Random shock settings updated by ${user.nickname}:`, randomShockSettings);
         res.json({ 
             message: 'Settings updated successfully',
             settings: randomShockSettings,
             active: randomShockingActive,
-            next_shock_scheduled: randomShockTimeout !== null
+            next_shock_scheduled: randomShockTimeout !== null || randomPatternRunning
         });
     });
 
@@ -387,6 +852,94 @@ const path = require('path');
         powerRange: { min: 10, max: 80 }         // Power level (10-80)
     };
 
+    // On-device random pattern
+    // The MCU runs the whole session from a pattern (gap, power, pulse, forever), so Node and USB are out of the timing
+    // path. The power ramps during the gap. Firmware without patterns doesn't take the upload and the host times the
+    // shocks itself as before.
+        const PATTERN_OPCODES = {
+            end: 0x00,
+            powerRandom: 0x02, // min, max
+            pulseRandom: 0x04, // min ms, max ms
+            waitRandom: 0x06,  // min, max in PATTERN_WAIT_UNIT_MS
+            loop: 0x07,        // start offset, count (0 = forever)
+        };
+        const PATTERN_WAIT_UNIT_MS = 10;
+        const PATTERN_FLAG_PREPOSITION = 0x01;
+        const RANDOM_PATTERN_SLOT = 0;
+
+        let randomPatternMode = false;    // The session runs on the MCU, not from scheduleNextRandomShock
+        let randomPatternRunning = false;
+        let randomPatternRun = 0;         // Counts the updates, only the newest one acts on its pattern ending
+        let randomPatternQueued = false;  // An update is waiting, it will pick up the newest settings
+        let randomPatternUpdate = Promise.resolve();
+
+        function patternWord(value) {
+            return [value & 0xFF, (value >> 8) & 0xFF];
+        }
+
+        function buildRandomPattern(settings) {
+            const gapMin = Math.round(settings.gapRange.min / PATTERN_WAIT_UNIT_MS);
+            const gapMax = Math.round(settings.gapRange.max / PATTERN_WAIT_UNIT_MS);
+            return [
+                PATTERN_OPCODES.waitRandom, ...patternWord(gapMin), ...patternWord(gapMax),
+                PATTERN_OPCODES.powerRandom, settings.powerRange.min, settings.powerRange.max,
+                PATTERN_OPCODES.pulseRandom, ...patternWord(settings.durationRange.min), ...patternWord(settings.durationRange.max),
+                PATTERN_OPCODES.loop, 0, 0,
+                PATTERN_OPCODES.end,
+            ];
+        }
+
+        async function uploadAndStartRandomPattern() {
+            if (!randomShockingActive || !serialPort || !serialPort.isOpen) return;
+
+            // The upload ends the pattern that is running, it is not restarted as a takeover
+            const run = ++randomPatternRun;
+            randomPatternRunning = false;
+            try {
+                await sendMcuFrame(FRAME_OPCODES.patternUpload, [RANDOM_PATTERN_SLOT, ...buildRandomPattern(randomShockSettings)]);
+            } catch (error) {
+                console.log(`- Pattern upload failed (${error.message}), timing random shocks from the host`);
+                randomPatternMode = false;
+                if (randomShockingActive && randomShockSettings.enabled) {
+                    scheduleNextRandomShock();
+                }
+                return;
+            }
+
+            // Random shocking may have been stopped during the upload
+            if (!randomShockingActive) return;
+
+            const seed = Math.floor(Math.random() * 0x10000);
+            randomPatternRunning = true;
+            console.log(`- Random pattern started on the MCU, seed ${seed}`);
+            sendMcuFrame(FRAME_OPCODES.patternStart, [RANDOM_PATTERN_SLOT, ...patternWord(seed), PATTERN_FLAG_PREPOSITION], { completeTimeoutMs: 2 ** 31 - 1 })
+                .then(result => {
+                    console.log(`- Random pattern ended as ${result.status}`);
+                    // A manual command took over or a guest's stop ended the pattern, carry on with the session afterwards
+                    // (it starts with a gap). stopRandomShocking() clears randomShockingActive before it sends its stop.
+                    const interrupted = result.status === 'superseded' || result.status === 'cancelled';
+                    if (interrupted && run === randomPatternRun && randomShockingActive && randomPatternMode) {
+                        startRandomPattern();
+                    }
+                })
+                .catch(error => console.error('Random pattern failed:', error.message))
+                .finally(() => {
+                    if (run === randomPatternRun) randomPatternRunning = false;
+                });
+        }
+
+        // Uploads the pattern for the current settings and (re)starts it, one update at a time
+        function startRandomPattern() {
+            randomPatternMode = true;
+            if (randomPatternQueued) return;
+
+            randomPatternQueued = true;
+            randomPatternUpdate = randomPatternUpdate.then(() => {
+                randomPatternQueued = false;
+                return uploadAndStartRandomPattern();
+            });
+        }
+
     // Function to get random value within range
     function getRandomInRange(min, max) {
         return Math.floor(Math.random() * (max - min + 1)) + min;
@@ -407,24 +960,46 @@ const path = require('path');
         console.log(`- Random shock scheduled: ${timestamp} - Power: ${power} - Duration: ${duration}ms`);
 
         try {
-            // Set power level
-            const powerCommand = `P${power}!`;
-            serialPort.write(powerCommand);
-            
-            // Wait a moment for power to be set
-            await new Promise(resolve => setTimeout(resolve, 10000));
-            
-            // Start shock
-            serialPort.write('1');
-            console.log(`- Random shock started: Power ${power} for ${duration}ms`);
-            
-            // Stop shock after duration
-            setTimeout(() => {
-                if (serialPort && serialPort.isOpen) {
-                    serialPort.write('0');
-                    console.log(`-  Random shock ended after ${duration}ms`);
+            // Set power level and wait until the MCU reports it is done
+            let framedProtocol = true;
+            try {
+                const result = await sendMcuFrame(FRAME_OPCODES.setPower, [power]);
+                if (result.status !== 'ok') {
+                    console.log(`- Random shock power change ended as ${result.status} at power ${result.powerLevel}`);
                 }
-            }, duration);
+            } catch (error) {
+                // Firmware without the framed protocol, use the ASCII command and wait a moment for power to be set
+                console.log(`- Framed power command failed (${error.message}), falling back to ASCII`);
+                framedProtocol = false;
+                writeToMcu(`P${power}!`);
+                await new Promise(resolve => setTimeout(resolve, 10000));
+            }
+
+            // Random shocking may have been stopped while the power was changing
+            if (!randomShockingActive || !serialPort || !serialPort.isOpen) {
+                console.log('Random shock cancelled - system stopped while setting power');
+                return;
+            }
+            
+            if (framedProtocol) {
+                // The MCU times the pulse itself, so event loop stalls or a lost stop can't stretch it
+                sendMcuFrame(FRAME_OPCODES.shockPulse, [duration & 0xFF, duration >> 8], { completeTimeoutMs: duration + 5000 })
+                    .then(result => console.log(`-  Random shock ended as ${result.status} after ${duration}ms`))
+                    .catch(error => console.error('Random shock pulse failed:', error.message));
+                console.log(`- Random shock started: Power ${power} for ${duration}ms`);
+            } else {
+                // Older firmware would read the digits of D<ms>! as start and stop commands, so time the shock here
+                writeToMcu('1');
+                console.log(`- Random shock started: Power ${power} for ${duration}ms`);
+
+                // Stop shock after duration
+                setTimeout(() => {
+                    if (serialPort && serialPort.isOpen) {
+                        writeToMcu('0');
+                        console.log(`-  Random shock ended after ${duration}ms`);
+                    }
+                }, duration);
+            }
             
             // Schedule next shock only if still active and enabled
             if (randomShockingActive && randomShockSettings.enabled) {
@@ -479,7 +1054,7 @@ const path = require('path');
         randomShockingActive = true;
         randomShockSettings.enabled = true;
         console.log('- Random shocking mode STARTED');
-        scheduleNextRandomShock();
+        startRandomPattern();
         return true;
     }
 
@@ -487,6 +1062,7 @@ const path = require('path');
     function stopRandomShocking() {
         randomShockingActive = false;
         randomShockSettings.enabled = false;
+        randomPatternMode = false;
         
         // Clear any pending timeouts
         if (randomShockTimeout) {
@@ -495,9 +1071,9 @@ const path = require('path');
             console.log('- Cancelled pending random shock');
         }
         
-        // Emergency stop - send stop command to MCU
+        // Emergency stop - send stop command to MCU, this also ends the pattern
         if (serialPort && serialPort.isOpen) {
-            serialPort.write('0');
+            writeToMcu('0');
         }
         
         console.log('- Random shocking mode STOPPED');
@@ -655,6 +1231,7 @@ const path = require('path');
             ws.send(JSON.stringify({
                 type: 'status',
                 mcu_status: currentMcuStatus,
+                mcu_channels: Object.fromEntries(mcuChannels),
                 user_commands: {
                     start: Array.from(userCommands.start),
                     stop: Array.from(userCommands.stop)
@@ -677,7 +1254,7 @@ const path = require('path');
                         }
 
                         if (data.command === 'start' && serialPort && serialPort.isOpen) {
-                            serialPort.write('1');
+                            writeToMcu('1');
                             console.log(`START command from ${user.nickname} (${user.role})`);
 
                             // Track user command by IP
@@ -686,7 +1263,7 @@ const path = require('path');
                             wsBroadcastMcuStatus();
 
                         } else if (data.command === 'stop' && serialPort && serialPort.isOpen) {
-                            serialPort.write('0');
+                            writeToMcu('0');
                             console.log(`STOP command from ${user.nickname} (${user.role})`);
 
                             // Track user command by IP
@@ -702,7 +1279,7 @@ const path = require('path');
 
                             if (serialPort && serialPort.isOpen) {
                                 const mcuCommandString = `P${powerLevel}!`;
-                                serialPort.write(mcuCommandString);
+                                writeToMcu(mcuCommandString);
                                 console.log(`Power level set to ${currentMcuPowerLevel} by ${user.nickname} (${user.role})`);
                                 wsBroadcastMcuStatus();
                             } else {
@@ -713,8 +1290,12 @@ const path = require('path');
                                 }));
                             }
                         } else if (data.command === 'calibrate' && serialPort && serialPort.isOpen) {
-                            serialPort.write('C');
+                            writeToMcu('C');
                             console.log(`CALIBRATE command from ${user.nickname} (${user.role})`);
+                        } else if (data.command === 'verify_calibration' && serialPort && serialPort.isOpen) {
+                            // Quick re-home from the current power level, ESP32 firmware only
+                            writeToMcu('V');
+                            console.log(`VERIFY CALIBRATION command from ${user.nickname} (${user.role})`);
                         }
 
                     } else if (data.type === 'ping') {
@@ -759,6 +1340,7 @@ const path = require('path');
             type: 'status',
             mcu_status: currentMcuStatus,
             mcu_power_level: currentMcuPowerLevel,
+            mcu_channels: Object.fromEntries(mcuChannels),
             user_commands: {
                 start: Array.from(userCommands.start),
                 stop: Array.from(userCommands.stop)
@@ -777,6 +1359,8 @@ const path = require('path');
         wsBroadcastUsers();
     }, 4000);
 
+    setInterval(logMcuMetrics, MCU_METRICS_INTERVAL_MS);
+
 
 // Start serverwsBroadcastStatus
     server.listen(PORT, async () => {
@@ -4,12 +4,14 @@ import { useState } from 'react';
 
 function CalibrationPanel({ mcuStatus, sendMcuCommand, isWebSocketConnected, myUser }) {
     const [calibrationStatus, setCalibrationStatus] = useState(''); // '', 'sent', 'error'
+    const [calibrationCommand, setCalibrationCommand] = useState('calibrate'); // Command the status belongs to
 
-    // Send calibrate command
-    const sendCalibrate = () => {
+    // Send calibrate command, 'verify_calibration' is the quick re-home from the current power level
+    const sendCalibrate = (command) => {
+        setCalibrationCommand(command);
         if (isWebSocketConnected && mcuStatus !== 'disconnected') {
-            sendMcuCommand('calibrate');
-            console.log('Calibrate command sent');
+            sendMcuCommand(command);
+            console.log(`${command} command sent`);
             setCalibrationStatus('sent');
             
             // Clear status after 2 seconds
@@ -26,6 +28,8 @@ function CalibrationPanel({ mcuStatus, sendMcuCommand, isWebSocketConnected, myU
         }
     };
 
+    const buttonStatus = (command) => calibrationCommand === command ? calibrationStatus : '';
+
     return (
         <div className={styles.container}>
             <div className={styles.card}>
@@ -36,22 +40,37 @@ function CalibrationPanel({ mcuStatus, sendMcuCommand, isWebSocketConnected, myU
                 <p className={styles.description}>
                     Calibrate the power output to ensure accurate shock delivery.
                     This will run a calibration sequence on the device.
+                    Quick Verify only re-checks the current power level and takes a few seconds.
                 </p>
 
                 {/* Calibrate button */}
                 <button
-                    onClick={sendCalibrate}
+                    onClick={() => sendCalibrate('calibrate')}
                     disabled={mcuStatus === "disconnected" || mcuStatus === "busy" || !isWebSocketConnected || myUser?.role === "bottom"}
                     className={`${styles.calibrateButton} ${
-                        calibrationStatus === 'sent' ? styles.calibrateButtonSuccess :
-                        calibrationStatus === 'error' ? styles.calibrateButtonError : ''
+                        buttonStatus('calibrate') === 'sent' ? styles.calibrateButtonSuccess :
+                        buttonStatus('calibrate') === 'error' ? styles.calibrateButtonError : ''
                     }`}
                 >
-                    {calibrationStatus === 'sent' ? '✓ Calibration Sent' :
-                     calibrationStatus === 'error' ? '✗ Connection Error' :
+                    {buttonStatus('calibrate') === 'sent' ? '✓ Calibration Sent' :
+                     buttonStatus('calibrate') === 'error' ? '✗ Connection Error' :
                      'Start Calibration'}
                 </button>
 
+                {/* Quick verify button */}
+                <button
+                    onClick={() => sendCalibrate('verify_calibration')}
+                    disabled={mcuStatus === "disconnected" || mcuStatus === "busy" || !isWebSocketConnected || myUser?.role === "bottom"}
+                    className={`${styles.calibrateButton} ${
+                        buttonStatus('verify_calibration') === 'sent' ? styles.calibrateButtonSuccess :
+                        buttonStatus('verify_calibration') === 'error' ? styles.calibrateButtonError : ''
+                    }`}
+                >
+                    {buttonStatus('verify_calibration') === 'sent' ? '✓ Verify Sent' :
+                     buttonStatus('verify_calibration') === 'error' ? '✗ Connection Error' :
+                     'Quick Verify'}
+                </button>
+
                 {/* Status info */}
                 <div className={styles.statusInfo}>
                     <p className={styles.statusLabel}>Device Status:</p>
@@ -0,0 +1,172 @@
+// Arduino API subset for running the firmware on the host under a virtual clock.
+// The simulation itself is controlled through ArduinoSim.h.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+
+// Constants
+    #define HIGH 0x1
+    #define LOW 0x0
+
+    #define INPUT 0x0
+    #define OUTPUT 0x1
+    #define INPUT_PULLUP 0x2
+
+    #define DEC 10
+    #define HEX 16
+
+    typedef uint8_t byte;
+    typedef bool boolean;
+
+
+// Time and pins
+    unsigned long millis();
+    unsigned long micros();
+    void delay(unsigned long ms);
+    void delayMicroseconds(unsigned int us);
+
+    void pinMode(uint8_t pin, uint8_t mode);
+    void digitalWrite(uint8_t pin, uint8_t val);
+    int digitalRead(uint8_t pin);
+
+    inline bool isDigit(int c){
+        return c >= '0' && c <= '9';
+    }
+
+
+// Interrupts
+// Nothing runs between two instructions of the host build, interrupts only fire while the clock moves (see ArduinoSim.h)
+    inline void noInterrupts(){}
+    inline void interrupts(){}
+    #define ISR(vector, ...) extern "C" void vector()
+    #define IRAM_ATTR
+
+
+// AVR Timer1 and Timer2
+// The part of both timers needed for CTC mode with the compare A interrupt, clocked like a 16 MHz ATmega328.
+// Register writes take effect right away, reading TCNT1 or TCNT2 returns the last value written.
+    namespace sim {
+        void timer1Written(const void *reg);
+        void timer2Written(const void *reg);
+    }
+    template <typename T, void (*WRITTEN)(const void *)> class TimerRegister {
+    public:
+        TimerRegister &operator=(T v){ value = v; WRITTEN(this); return *this; }
+        TimerRegister &operator|=(T v){ return *this = (T)(value | v); }
+        TimerRegister &operator&=(T v){ return *this = (T)(value & v); }
+        operator T() const { return value; }
+
+    private:
+        T value = 0;
+    };
+    extern TimerRegister<uint8_t, sim::timer1Written> TCCR1A, TCCR1B, TIMSK1, TIFR1;
+    extern TimerRegister<uint16_t, sim::timer1Written> TCNT1, OCR1A;
+    extern TimerRegister<uint8_t, sim::timer2Written> TCCR2A, TCCR2B, TIMSK2, TIFR2, TCNT2, OCR2A;
+
+    #define _BV(bit) (1 << (bit))
+    #define CS10 0
+    #define CS11 1
+    #define CS12 2
+    #define WGM12 3
+    #define OCIE1A 1
+    #define OCF1A 1
+    #define CS20 0
+    #define CS21 1
+    #define CS22 2
+    #define WGM21 1
+    #define OCIE2A 1
+    #define OCF2A 1
+
+    extern "C" void TIMER1_COMPA_vect() __attribute__((weak));
+    extern "C" void TIMER2_COMPA_vect() __attribute__((weak));
+
+
+// Program memory
+// The host has one address space, so F() and PROGMEM data are read like any other.
+    class __FlashStringHelper;
+    #define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+    #define PROGMEM
+    #define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+
+// String
+    class String {
+    public:
+        String(const char *str = "") : value(str) {}
+        String(char c) : value(1, c) {}
+        String(int number) : value(std::to_string(number)) {}
+        String(long number) : value(std::to_string(number)) {}
+        String(unsigned long number) : value(std::to_string(number)) {}
+
+        String &operator+=(char c){ value += c; return *this; }
+        String &operator+=(const char *str){ value += str; return *this; }
+        String &operator+=(const String &str){ value += str.value; return *this; }
+        bool operator==(const char *str) const { return value == str; }
+
+        unsigned int length() const { return value.length(); }
+        const char *c_str() const { return value.c_str(); }
+        long toInt() const { return atol(value.c_str()); }
+
+    private:
+        std::string value;
+    };
+
+
+// Print and Serial
+    #ifndef SERIAL_RX_BUFFER_SIZE
+        #define SERIAL_RX_BUFFER_SIZE 64 // Like the AVR core, a build flag can change it. Only sim::setSerialRxBufferSize() limits the host's buffer.
+    #endif
+
+    class Print {
+    public:
+        virtual ~Print(){}
+
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size){
+            for(size_t i = 0; i < size; i++)
+                write(buffer[i]);
+            return size;
+        }
+        size_t write(const char *str){ return write((const uint8_t *)str, strlen(str)); }
+
+        size_t print(const char *str){ return write(str); }
+        size_t print(const __FlashStringHelper *str){ return write((const char *)str); }
+        size_t print(const String &str){ return write(str.c_str()); }
+        size_t print(char c){ return write((uint8_t)c); }
+        size_t print(int number, int base = DEC){ return print((long)number, base); }
+        size_t print(unsigned int number, int base = DEC){ return print((unsigned long)number, base); }
+        size_t print(long number, int base = DEC);
+        size_t print(unsigned long number, int base = DEC);
+
+        template <typename T> size_t println(const T &value){ return print(value) + write("\n"); }
+        size_t println(){ return write("\n"); }
+    };
+
+    class HardwareSerial : public Print {
+    public:
+        void begin(unsigned long baud);
+        size_t setRxBufferSize(size_t bytes); // ESP32, sets sim::setSerialRxBufferSize()
+        void end(){}
+        explicit operator bool() const { return true; }
+
+        int available();
+        int read();
+        int peek();
+        int availableForWrite();
+        void flush(){}
+
+        using Print::write;
+        size_t write(uint8_t c) override;
+        size_t write(const uint8_t *buffer, size_t size) override;
+    };
+    extern HardwareSerial Serial;
+
+
+// Sketch entry points
+    void setup();
+    void loop();
@@ -0,0 +1,404 @@
+#include "Arduino.h"
+#include "ArduinoSim.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <deque>
+
+// State
+    namespace {
+        struct RxByte {
+            uint64_t timeUs; // Virtual time the byte becomes readable
+            uint8_t value;
+        };
+
+        uint64_t clockUs = 0;
+        uint32_t loopCostUs = 10;
+
+        uint8_t pinLevels[256];
+        std::vector<sim::PinEdge> edges;
+
+        uint32_t byteTimeUs = 87; // One 10 bit UART frame at 115200 baud
+        std::deque<RxByte> rxQueue;
+        uint64_t rxLastUs = 0;
+        size_t rxBuffered = 0;     // Bytes at the front of rxQueue that arrived and made it into the RX buffer
+        size_t rxBufferSize = 0;   // 0 for no limit
+        uint64_t rxDropped = 0;
+        std::string txLine;
+        std::vector<sim::SerialLine> lines;
+        std::vector<uint8_t> txFrame;
+        std::vector<sim::SerialFrame> frames;
+
+        struct PendingInterrupt {
+            uint64_t timeUs;
+            uint32_t id;
+            void (*handler)(void *);
+            void *arg;
+        };
+        std::vector<PendingInterrupt> pendingInterrupts;
+        uint32_t nextInterruptId = 1;
+        bool inInterrupt = false;
+        uint64_t sleptTotalUs = 0;
+
+        const uint64_t TIMER0_TICK_US = 1024; // 64 * 256 cycles at 16 MHz
+
+        // Moves the clock forward, running every interrupt that comes due on the way with the clock set to its time.
+        // The clock stands still inside a handler.
+        void advanceClock(uint64_t us){
+            if(inInterrupt)
+                return;
+
+            uint64_t target = clockUs + us;
+            for(;;){
+                size_t next = pendingInterrupts.size();
+                for(size_t i = 0; i < pendingInterrupts.size(); i++){
+                    if(pendingInterrupts[i].timeUs <= target && (next == pendingInterrupts.size() || pendingInterrupts[i].timeUs < pendingInterrupts[next].timeUs))
+                        next = i;
+                }
+                if(next == pendingInterrupts.size())
+                    break;
+
+                PendingInterrupt interrupt = pendingInterrupts[next];
+                pendingInterrupts.erase(pendingInterrupts.begin() + next);
+                if(interrupt.timeUs > clockUs)
+                    clockUs = interrupt.timeUs;
+                inInterrupt = true;
+                interrupt.handler(interrupt.arg);
+                inInterrupt = false;
+            }
+            clockUs = target;
+        }
+    }
+
+
+// Arduino API
+    // Reading the clock costs 1 us so busy-wait loops in the firmware still see time pass
+    unsigned long millis(){
+        advanceClock(1);
+        return (unsigned long)(clockUs / 1000);
+    }
+    unsigned long micros(){
+        advanceClock(1);
+        return (unsigned long)clockUs;
+    }
+    void delay(unsigned long ms){
+        advanceClock((uint64_t)ms * 1000);
+    }
+    void delayMicroseconds(unsigned int us){
+        advanceClock(us);
+    }
+
+    void pinMode(uint8_t pin, uint8_t mode){
+        (void)pin;
+        (void)mode;
+    }
+    void digitalWrite(uint8_t pin, uint8_t val){
+        uint8_t level = val ? HIGH : LOW;
+        if(pinLevels[pin] == level)
+            return;
+
+        pinLevels[pin] = level;
+        edges.push_back({clockUs, pin, level});
+    }
+    int digitalRead(uint8_t pin){
+        return pinLevels[pin];
+    }
+
+    HardwareSerial Serial;
+
+    void HardwareSerial::begin(unsigned long baud){
+        byteTimeUs = (uint32_t)(10000000UL / baud);
+    }
+    size_t HardwareSerial::setRxBufferSize(size_t bytes){
+        sim::setSerialRxBufferSize(bytes);
+        return bytes;
+    }
+    // Moves the bytes that arrived since the last call into the RX buffer. Nothing was read in between,
+    // so a byte that arrived with the buffer full is dropped the way the UART driver drops it.
+    static void fillRxBuffer(){
+        while(rxBuffered < rxQueue.size() && rxQueue[rxBuffered].timeUs <= clockUs){
+            if(rxBufferSize != 0 && rxBuffered >= rxBufferSize){
+                rxQueue.erase(rxQueue.begin() + rxBuffered);
+                rxDropped++;
+            } else {
+                rxBuffered++;
+            }
+        }
+    }
+    int HardwareSerial::available(){
+        fillRxBuffer();
+        return (int)rxBuffered;
+    }
+    int HardwareSerial::read(){
+        int value = peek();
+        if(value >= 0){
+            rxQueue.pop_front();
+            rxBuffered--;
+        }
+        return value;
+    }
+    int HardwareSerial::peek(){
+        fillRxBuffer();
+        if(rxBuffered == 0)
+            return -1;
+        return rxQueue.front().value;
+    }
+    int HardwareSerial::availableForWrite(){
+        return 64;
+    }
+    size_t HardwareSerial::write(uint8_t c){
+        if(!txFrame.empty()){
+            txFrame.push_back(c);
+            if(txFrame.size() > 1 && txFrame.size() == 5u + txFrame[1]){
+                frames.push_back({clockUs, txFrame});
+                txFrame.clear();
+            }
+            return 1;
+        }
+
+        if(c == 0xA5 && txLine.empty()){
+            txFrame.push_back(c);
+        } else if(c == '\n'){
+            lines.push_back({clockUs, txLine});
+            txLine.clear();
+        } else {
+            txLine += (char)c;
+        }
+        return 1;
+    }
+    size_t HardwareSerial::write(const uint8_t *buffer, size_t size){
+        for(size_t i = 0; i < size; i++)
+            write(buffer[i]);
+        return size;
+    }
+    size_t Print::print(long number, int base){
+        if(number < 0)
+            return write("-") + print((unsigned long)-number, base);
+        return print((unsigned long)number, base);
+    }
+    size_t Print::print(unsigned long number, int base){
+        char buffer[8 * sizeof(long) + 1];
+        char *p = &buffer[sizeof(buffer) - 1];
+        *p = '\0';
+        do {
+            unsigned long digit = number % base;
+            *--p = (char)(digit < 10 ? '0' + digit : 'A' + digit - 10);
+            number /= base;
+        } while(number);
+        return write(p);
+    }
+
+
+// Simulation controls
+    namespace sim {
+        void reset(){
+            clockUs = 0;
+            memset(pinLevels, LOW, sizeof(pinLevels));
+            edges.clear();
+            rxQueue.clear();
+            rxLastUs = 0;
+            rxBuffered = 0;
+            rxBufferSize = 0;
+            rxDropped = 0;
+            txLine.clear();
+            lines.clear();
+            txFrame.clear();
+            frames.clear();
+            pendingInterrupts.clear();
+            inInterrupt = false;
+            sleptTotalUs = 0;
+        }
+        void boot(){
+            reset();
+            setup();
+        }
+        uint64_t nowUs(){
+            return clockUs;
+        }
+        void advanceUs(uint64_t us){
+            advanceClock(us);
+        }
+        void setLoopCostUs(uint32_t us){
+            loopCostUs = us;
+        }
+
+        void runLoop(){
+            loop();
+            advanceClock(loopCostUs);
+        }
+        void runForUs(uint64_t us){
+            uint64_t end = clockUs + us;
+            while(clockUs < end)
+                runLoop();
+        }
+        bool runUntil(const std::function<bool()> &done, uint64_t timeoutUs){
+            uint64_t end = clockUs + timeoutUs;
+            while(!done()){
+                if(clockUs >= end)
+                    return false;
+                runLoop();
+            }
+            return true;
+        }
+
+        uint32_t scheduleInterrupt(uint64_t timeUs, void (*handler)(void *), void *arg){
+            uint32_t id = nextInterruptId++;
+            pendingInterrupts.push_back({timeUs, id, handler, arg});
+            return id;
+        }
+        void sleepUntilInterrupt(){
+            uint64_t wake = (clockUs / TIMER0_TICK_US + 1) * TIMER0_TICK_US;
+            for(const PendingInterrupt &interrupt : pendingInterrupts){
+                if(interrupt.timeUs < wake)
+                    wake = interrupt.timeUs;
+            }
+            if(rxBuffered < rxQueue.size() && rxQueue[rxBuffered].timeUs < wake)
+                wake = rxQueue[rxBuffered].timeUs;
+
+            if(wake > clockUs){
+                sleptTotalUs += wake - clockUs;
+                advanceClock(wake - clockUs);
+            }
+        }
+        uint64_t sleptUs(){
+            return sleptTotalUs;
+        }
+
+        void cancelInterrupt(uint32_t id){
+            for(size_t i = 0; i < pendingInterrupts.size(); i++){
+                if(pendingInterrupts[i].id == id){
+                    pendingInterrupts.erase(pendingInterrupts.begin() + i);
+                    return;
+                }
+            }
+        }
+
+        uint64_t sendSerial(const char *bytes){
+            return sendSerialAt(clockUs, bytes);
+        }
+        uint64_t sendSerial(const uint8_t *bytes, size_t length){
+            return sendSerialAt(clockUs, bytes, length);
+        }
+        uint64_t sendSerialAt(uint64_t timeUs, const char *bytes){
+            return sendSerialAt(timeUs, (const uint8_t *)bytes, strlen(bytes));
+        }
+        uint64_t sendSerialAt(uint64_t timeUs, const uint8_t *bytes, size_t length){
+            uint64_t t = rxLastUs > timeUs ? rxLastUs : timeUs;
+            for(size_t i = 0; i < length; i++){
+                t += byteTimeUs;
+                rxQueue.push_back({t, bytes[i]});
+            }
+            rxLastUs = t;
+            return t;
+        }
+        uint64_t replayRecording(const std::string &text){
+            uint64_t last = 0;
+            size_t start = 0;
+            while(start < text.size()){
+                size_t end = text.find('\n', start);
+                end = end == std::string::npos ? text.size() : end;
+                std::string line = text.substr(start, end - start);
+                start = end + 1;
+
+                // "@<ms> <hex>", with an optional '\r' from a Windows capture
+                if(line.empty() || line[0] != '@' || !isDigit(line[1]))
+                    continue;
+                char *hex = nullptr;
+                unsigned long long ms = strtoull(line.c_str() + 1, &hex, 10);
+                if(*hex != ' ')
+                    continue;
+                hex++;
+
+                std::vector<uint8_t> bytes;
+                while(isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1])){
+                    char pair[3] = { hex[0], hex[1], 0 };
+                    bytes.push_back((uint8_t)strtoul(pair, nullptr, 16));
+                    hex += 2;
+                }
+                if(bytes.empty() || (*hex != 0 && *hex != '\r'))
+                    continue;
+                last = sendSerialAt(ms * 1000, bytes.data(), bytes.size());
+            }
+            return last;
+        }
+        void setSerialRxBufferSize(size_t bytes){
+            rxBufferSize = bytes;
+        }
+        uint64_t serialRxDropped(){
+            return rxDropped;
+        }
+        const std::vector<SerialLine> &serialLines(){
+            return lines;
+        }
+        const std::vector<SerialFrame> &serialFrames(){
+            return frames;
+        }
+        int findLine(const char *text, size_t from){
+            for(size_t i = from; i < lines.size(); i++){
+                if(lines[i].text == text)
+                    return (int)i;
+            }
+            return -1;
+        }
+
+        const std::vector<PinEdge> &pinEdges(){
+            return edges;
+        }
+        int pinLevel(uint8_t pin){
+            return pinLevels[pin];
+        }
+        int64_t findEdge(uint8_t pin, uint8_t level, uint64_t afterUs){
+            for(const PinEdge &edge : edges){
+                if(edge.timeUs >= afterUs && edge.pin == pin && edge.level == level)
+                    return (int64_t)edge.timeUs;
+            }
+            return -1;
+        }
+    }
+
+
+// Runner
+// `program [seconds] < commands.txt` boots the sketch and feeds stdin to Serial, right away or, for a recording (see
+// sim::replayRecording()), at the times it was recorded. It runs until the given virtual time (30 s by default) after
+// the last byte, then prints the serial lines, frames and pin edges in time order. The same input always gives the same
+// output, so two runs can be diffed. Test builds provide their own main().
+    __attribute__((weak)) int main(int argc, char **argv){
+        double seconds = argc > 1 ? atof(argv[1]) : 30.0;
+
+        sim::boot();
+
+        std::string input;
+        int c;
+        while((c = getchar()) != EOF)
+            input += (char)c;
+        uint64_t last = sim::replayRecording(input);
+        if(last == 0)
+            last = sim::sendSerial(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+
+        sim::runForUs(last - clockUs + (uint64_t)(seconds * 1000000.0));
+
+        size_t l = 0, f = 0, e = 0;
+        const uint64_t NONE = UINT64_MAX;
+        for(;;){
+            uint64_t line_us = l < lines.size() ? lines[l].timeUs : NONE;
+            uint64_t frame_us = f < frames.size() ? frames[f].timeUs : NONE;
+            uint64_t edge_us = e < edges.size() ? edges[e].timeUs : NONE;
+            if(line_us == NONE && frame_us == NONE && edge_us == NONE)
+                break;
+
+            if(line_us <= frame_us && line_us <= edge_us){
+                printf("%12.3f ms  serial  %s\n", line_us / 1000.0, lines[l].text.c_str());
+                l++;
+            } else if(frame_us <= edge_us){
+                printf("%12.3f ms  frame  ", frame_us / 1000.0);
+                for(uint8_t byte : frames[f].bytes)
+                    printf(" %02x", byte);
+                printf("\n");
+                f++;
+            } else {
+                printf("%12.3f ms  pin %-3u %s\n", edge_us / 1000.0, edges[e].pin, edges[e].level ? "HIGH" : "LOW");
+                e++;
+            }
+        }
+        return 0;
+    }
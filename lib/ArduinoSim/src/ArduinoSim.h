@@ -0,0 +1,90 @@
+// Simulation controls for the host build.
+// Time only moves when the firmware calls delay() or reads the clock (1 us per read), or when the runner charges
+// the cost of a loop() iteration, so every run of the same script produces the same pin edges and serial output.
+// Timer interrupts run at their exact virtual time whenever the clock moves past it.
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+    struct PinEdge {
+        uint64_t timeUs; // Virtual time of the change
+        uint8_t pin;
+        uint8_t level;
+    };
+
+    struct SerialLine {
+        uint64_t timeUs;  // Virtual time the '\n' was written
+        std::string text; // Line without the '\n'
+    };
+
+    // Binary frames (0xA5, length, opcode, sequence, payload, CRC) are split off the text lines like the host does
+    struct SerialFrame {
+        uint64_t timeUs;            // Virtual time the CRC was written
+        std::vector<uint8_t> bytes; // Whole frame including the 0xA5
+    };
+
+    // Clock
+        // Clears the clock, pins, serial buffers and logs. Firmware globals are not touched.
+        void reset();
+        // reset() followed by setup()
+        void boot();
+        uint64_t nowUs();
+        void advanceUs(uint64_t us);
+        // Virtual time charged for every loop() iteration run by the runner (default 10 us)
+        void setLoopCostUs(uint32_t us);
+
+    // Interrupts
+        // Runs handler(arg) once the clock passes timeUs, with the clock reading timeUs while it runs. Returns an id for cancelInterrupt().
+        uint32_t scheduleInterrupt(uint64_t timeUs, void (*handler)(void *), void *arg);
+        // Does nothing if the interrupt already ran
+        void cancelInterrupt(uint32_t id);
+        // Moves the clock to the next scheduled interrupt, byte arriving on the RX line or Timer0 tick (every 1024 us, the
+        // millis() interrupt of a 16 MHz ATmega328), whichever comes first
+        void sleepUntilInterrupt();
+        // Virtual time spent in sleepUntilInterrupt() since reset()
+        uint64_t sleptUs();
+
+    // Running the sketch
+        void runLoop();
+        void runForUs(uint64_t us);
+        // Runs loop() until done() returns true, returns false if timeoutUs passes first
+        bool runUntil(const std::function<bool()> &done, uint64_t timeoutUs);
+
+    // Serial
+        // Queues bytes on the RX line behind anything already queued, paced at the baud rate given to Serial.begin().
+        // Returns the virtual time the last byte becomes readable.
+        uint64_t sendSerial(const char *bytes);
+        uint64_t sendSerial(const uint8_t *bytes, size_t length);
+        uint64_t sendSerialAt(uint64_t timeUs, const char *bytes);
+        uint64_t sendSerialAt(uint64_t timeUs, const uint8_t *bytes, size_t length);
+        // Queues the "@<ms> <bytes in hex>" lines of a recording (see Recorder in lib/ShockerCore) at their ms after boot,
+        // or right behind the line before if that is later. Other lines are skipped, so a serial monitor log or the
+        // server's capture file can be used as is. Returns the time the last byte becomes readable, 0 if there was none.
+        uint64_t replayRecording(const std::string &text);
+        // Bytes the RX buffer holds, bytes arriving while it is full are dropped. 0 (the default) for no limit.
+        void setSerialRxBufferSize(size_t bytes);
+        uint64_t serialRxDropped();
+        const std::vector<SerialLine> &serialLines();
+        const std::vector<SerialFrame> &serialFrames();
+        // Index of the first line equal to text at or after index from, -1 if none
+        int findLine(const char *text, size_t from = 0);
+
+    // Non-volatile storage
+    // EEPROM and Preferences keep their contents across reset() and boot(), erase them to simulate a new board.
+        // Bytes written to EEPROM, update() and put() don't count bytes that were already equal
+        uint64_t eepromWrites();
+        void eraseEeprom();
+        // Preferences puts, removes and clears
+        uint64_t nvsWrites();
+        void eraseNvs();
+
+    // Pins
+        const std::vector<PinEdge> &pinEdges();
+        int pinLevel(uint8_t pin);
+        // Time of the first edge of pin to level at or after afterUs, -1 if none
+        int64_t findEdge(uint8_t pin, uint8_t level, uint64_t afterUs);
+}
@@ -0,0 +1,87 @@
+#include "Arduino.h"
+#include "ArduinoSim.h"
+
+// Registers
+    TimerRegister<uint8_t, sim::timer1Written> TCCR1A, TCCR1B, TIMSK1, TIFR1;
+    TimerRegister<uint16_t, sim::timer1Written> TCNT1, OCR1A;
+    TimerRegister<uint8_t, sim::timer2Written> TCCR2A, TCCR2B, TIMSK2, TIFR2, TCNT2, OCR2A;
+
+
+// State
+    namespace {
+        // Counter of one timer in CTC mode, the registers are read through the timer's settings() function
+        struct CtcTimer {
+            struct Settings {
+                double tickUs;    // Length of one counter tick for the prescaler, 0 while stopped
+                bool isEnabled;   // CTC mode with the compare A interrupt enabled
+                uint16_t top;     // OCRnA
+                uint16_t counter; // TCNTn
+            };
+            Settings (*settings)();
+            void (*vector)();        // The sketch's ISR, null if it has none
+
+            bool isRunning = false;
+            double counterZeroUs = 0;      // Virtual time the counter was last at 0
+            uint32_t compareInterrupt = 0; // Pending compare match interrupt, 0 if none
+        };
+
+        void onCompareMatch(void *arg);
+
+        void scheduleCompareMatch(CtcTimer &timer){
+            if(timer.compareInterrupt){
+                sim::cancelInterrupt(timer.compareInterrupt);
+                timer.compareInterrupt = 0;
+            }
+
+            CtcTimer::Settings settings = timer.settings();
+            if(settings.tickUs == 0 || !settings.isEnabled)
+                return;
+
+            double match = timer.counterZeroUs + (settings.top + 1) * settings.tickUs;
+            timer.compareInterrupt = sim::scheduleInterrupt((uint64_t)(match + 0.5), onCompareMatch, &timer);
+        }
+
+        void onCompareMatch(void *arg){
+            CtcTimer &timer = *(CtcTimer *)arg;
+            CtcTimer::Settings settings = timer.settings();
+            timer.compareInterrupt = 0;
+            timer.counterZeroUs += (settings.top + 1) * settings.tickUs; // CTC clears the counter on the match
+
+            if(timer.vector)
+                timer.vector();
+            scheduleCompareMatch(timer);
+        }
+
+        void timerWritten(CtcTimer &timer, bool counter_written){
+            CtcTimer::Settings settings = timer.settings();
+            if(settings.tickUs == 0){
+                timer.isRunning = false;
+            } else if(!timer.isRunning || counter_written){
+                timer.isRunning = true;
+                timer.counterZeroUs = sim::nowUs() - settings.counter * settings.tickUs;
+            }
+            scheduleCompareMatch(timer);
+        }
+
+        // The two timers have different prescalers and keep their CTC bit in different registers
+        CtcTimer timer1 = { []{
+            static const double ticks[] = { 0, 1 / 16.0, 8 / 16.0, 64 / 16.0, 256 / 16.0, 1024 / 16.0, 0, 0 }; // 6 and 7 clock from the T1 pin, not simulated
+            return CtcTimer::Settings{ ticks[TCCR1B & 0x07], (TIMSK1 & _BV(OCIE1A)) && (TCCR1B & _BV(WGM12)), OCR1A, TCNT1 };
+        }, TIMER1_COMPA_vect };
+
+        CtcTimer timer2 = { []{
+            static const double ticks[] = { 0, 1 / 16.0, 8 / 16.0, 32 / 16.0, 64 / 16.0, 128 / 16.0, 256 / 16.0, 1024 / 16.0 };
+            return CtcTimer::Settings{ ticks[TCCR2B & 0x07], (TIMSK2 & _BV(OCIE2A)) && (TCCR2A & _BV(WGM21)), OCR2A, TCNT2 };
+        }, TIMER2_COMPA_vect };
+    }
+
+
+// Register writes
+    namespace sim {
+        void timer1Written(const void *reg){
+            timerWritten(timer1, reg == &TCNT1);
+        }
+        void timer2Written(const void *reg){
+            timerWritten(timer2, reg == &TCNT2);
+        }
+    }
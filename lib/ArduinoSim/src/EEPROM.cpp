@@ -0,0 +1,40 @@
+#include "EEPROM.h"
+#include "ArduinoSim.h"
+
+namespace {
+    uint8_t cells[1024];
+    bool isErased = false;
+    uint64_t writes = 0;
+
+    uint8_t &cell(int address){
+        if(!isErased){
+            memset(cells, 0xFF, sizeof(cells));
+            isErased = true;
+        }
+        return cells[(unsigned)address % sizeof(cells)];
+    }
+}
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address){
+    return cell(address);
+}
+void EEPROMClass::write(int address, uint8_t value){
+    cell(address) = value;
+    writes++;
+}
+void EEPROMClass::update(int address, uint8_t value){
+    if(cell(address) != value)
+        write(address, value);
+}
+
+namespace sim {
+    uint64_t eepromWrites(){
+        return writes;
+    }
+    void eraseEeprom(){
+        memset(cells, 0xFF, sizeof(cells));
+        isErased = true;
+    }
+}
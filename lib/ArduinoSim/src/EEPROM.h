@@ -0,0 +1,29 @@
+// EEPROM library subset for the host build, 1 KB like an ATmega328.
+// The contents survive sim::reset() and sim::boot() the way real EEPROM survives a reset.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class EEPROMClass {
+public:
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    void update(int address, uint8_t value);
+    uint16_t length(){ return 1024; }
+
+    template <typename T> T &get(int address, T &value){
+        uint8_t *bytes = (uint8_t *)&value;
+        for(size_t i = 0; i < sizeof(T); i++)
+            bytes[i] = read(address + i);
+        return value;
+    }
+    // Like the AVR library, only bytes that differ are written
+    template <typename T> const T &put(int address, const T &value){
+        const uint8_t *bytes = (const uint8_t *)&value;
+        for(size_t i = 0; i < sizeof(T); i++)
+            update(address + i, bytes[i]);
+        return value;
+    }
+};
+extern EEPROMClass EEPROM;
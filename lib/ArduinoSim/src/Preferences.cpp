@@ -0,0 +1,82 @@
+#include "Preferences.h"
+#include "ArduinoSim.h"
+
+#include <string.h>
+#include <map>
+#include <vector>
+
+namespace {
+    std::map<std::string, std::vector<uint8_t>> entries; // "namespace/key" -> value
+    uint64_t writes = 0;
+
+    std::string entryName(const std::string &name, const char *key){
+        return name + "/" + key;
+    }
+}
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partition_label){
+    (void)partition_label;
+    this->name = name;
+    isOpen = true;
+    isReadOnly = readOnly;
+    return true;
+}
+void Preferences::end(){
+    isOpen = false;
+}
+
+bool Preferences::clear(){
+    if(!isOpen || isReadOnly)
+        return false;
+
+    std::string prefix = name + "/";
+    for(auto it = entries.begin(); it != entries.end();){
+        it = it->first.compare(0, prefix.size(), prefix) == 0 ? entries.erase(it) : std::next(it);
+    }
+    writes++;
+    return true;
+}
+bool Preferences::remove(const char *key){
+    if(!isOpen || isReadOnly || !entries.erase(entryName(name, key)))
+        return false;
+
+    writes++;
+    return true;
+}
+bool Preferences::isKey(const char *key){
+    return isOpen && entries.count(entryName(name, key));
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len){
+    if(!isOpen || isReadOnly || !len)
+        return 0;
+
+    const uint8_t *bytes = (const uint8_t *)value;
+    entries[entryName(name, key)].assign(bytes, bytes + len);
+    writes++;
+    return len;
+}
+size_t Preferences::getBytesLength(const char *key){
+    if(!isOpen)
+        return 0;
+
+    auto it = entries.find(entryName(name, key));
+    return it == entries.end() ? 0 : it->second.size();
+}
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen){
+    size_t length = getBytesLength(key);
+    if(!length || length > maxLen)
+        return 0;
+
+    memcpy(buf, entries[entryName(name, key)].data(), length);
+    return length;
+}
+
+namespace sim {
+    uint64_t nvsWrites(){
+        return writes;
+    }
+    void eraseNvs(){
+        entries.clear();
+    }
+}
@@ -0,0 +1,25 @@
+// Preferences (NVS) subset for the host build, only byte blobs.
+// The contents survive sim::reset() and sim::boot() the way flash survives a reset.
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+class Preferences {
+public:
+    bool begin(const char *name, bool readOnly = false, const char *partition_label = nullptr);
+    void end();
+
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+
+    size_t putBytes(const char *key, const void *value, size_t len);
+    size_t getBytesLength(const char *key);
+    size_t getBytes(const char *key, void *buf, size_t maxLen);
+
+private:
+    std::string name;
+    bool isOpen = false;
+    bool isReadOnly = false;
+};
@@ -0,0 +1,16 @@
+// The part of avr/sleep.h the Nano firmware uses. sleep_cpu() moves the clock to the next thing that would wake
+// an ATmega328 in SLEEP_MODE_IDLE, see sim::sleepUntilInterrupt().
+#pragma once
+
+#include "../ArduinoSim.h"
+
+#define SLEEP_MODE_IDLE 0
+
+inline void set_sleep_mode(uint8_t mode){
+    (void)mode;
+}
+inline void sleep_enable(){}
+inline void sleep_disable(){}
+inline void sleep_cpu(){
+    sim::sleepUntilInterrupt();
+}
@@ -0,0 +1,48 @@
+#include "esp_timer.h"
+#include "ArduinoSim.h"
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    uint32_t interrupt; // Pending sim interrupt, 0 if the timer isn't armed
+};
+
+namespace {
+    void onTimer(void *arg){
+        esp_timer_handle_t timer = (esp_timer_handle_t)arg;
+        timer->interrupt = 0;
+        timer->args.callback(timer->args.arg);
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle){
+    if(!create_args || !create_args->callback || !out_handle)
+        return ESP_ERR_INVALID_ARG;
+
+    *out_handle = new esp_timer{*create_args, 0};
+    return ESP_OK;
+}
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us){
+    if(timer->interrupt)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->interrupt = sim::scheduleInterrupt(sim::nowUs() + timeout_us, onTimer, timer);
+    return ESP_OK;
+}
+esp_err_t esp_timer_stop(esp_timer_handle_t timer){
+    if(!timer->interrupt)
+        return ESP_ERR_INVALID_STATE;
+
+    sim::cancelInterrupt(timer->interrupt);
+    timer->interrupt = 0;
+    return ESP_OK;
+}
+esp_err_t esp_timer_delete(esp_timer_handle_t timer){
+    if(timer->interrupt)
+        return ESP_ERR_INVALID_STATE;
+
+    delete timer;
+    return ESP_OK;
+}
+int64_t esp_timer_get_time(){
+    return (int64_t)sim::nowUs();
+}
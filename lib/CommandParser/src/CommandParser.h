@@ -0,0 +1,126 @@
+// Byte at a time parser for the serial commands of both firmwares: single characters, numbers like P<n>! and
+// 0xA5 frames (length, opcode, sequence, payload, CRC-8). It never allocates and never waits, loop() hands it
+// every byte as it arrives and polls it for timeouts, so other commands keep running while a slow host types.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define PARSER_FRAME_START 0xA5
+#define PARSER_MAX_DIGITS 5 // More digits than any command takes
+
+// CRC-8, poly 0x07, used by the frames and by anything else that needs a cheap check
+inline uint8_t crc8(const uint8_t *data, uint8_t length){
+    uint8_t crc = 0;
+    for(uint8_t i = 0; i < length; i++){
+        crc ^= data[i];
+        for(uint8_t bit = 0; bit < 8; bit++){
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+enum class ParseResult : uint8_t {
+    NONE,           // Nothing finished yet
+    COMMAND,        // Single character command, in command
+    NUMBER,         // Number command, letter in command and value in number
+    FRAME,          // Frame with a good CRC, see frameOpcode() and friends
+    BAD_NUMBER,     // Unexpected character or too many digits, letter in command
+    BAD_CRC,        // frameSequence() is still valid
+    FRAME_TOO_LONG, // Payload longer than MAX_PAYLOAD
+    TIMEOUT,        // The rest of a number (letter in command) or frame (command is PARSER_FRAME_START) didn't arrive in time
+};
+
+template <uint8_t MAX_PAYLOAD> struct CommandParser {
+    enum class State : uint8_t {
+        COMMAND, // Waiting for the first byte of a command
+        NUMBER,  // Reading digits up to the '!'
+        FRAME,   // Reading the rest of a frame
+    };
+
+    // Config
+        const char *numberCommands;    // Letters followed by a number and '!'
+        unsigned long numberTimeoutMs; // Time allowed from the letter to the '!'
+        unsigned long frameTimeoutMs;  // Time allowed from the 0xA5 to the CRC
+
+    // State
+        State state = State::COMMAND;
+        char command = 0;            // Last command letter, or PARSER_FRAME_START
+        uint32_t number = 0;
+        uint8_t digits = 0;
+        uint8_t frame[4 + MAX_PAYLOAD]; // Length, opcode, sequence, payload, CRC
+        uint8_t received = 0;        // Bytes of frame received
+        unsigned long startedAt = 0; // Time the command's first byte arrived
+
+    CommandParser(const char *number_commands, unsigned long number_timeout_ms, unsigned long frame_timeout_ms)
+        : numberCommands(number_commands), numberTimeoutMs(number_timeout_ms), frameTimeoutMs(frame_timeout_ms) {}
+
+    // Frame fields, valid after FRAME (and the sequence after BAD_CRC)
+        uint8_t frameLength() const { return frame[0]; }
+        uint8_t frameOpcode() const { return frame[1]; }
+        uint8_t frameSequence() const { return frame[2]; }
+        const uint8_t *framePayload() const { return &frame[3]; }
+
+    // Takes the next byte, now_ms is millis() when it was read
+    ParseResult feed(uint8_t c, unsigned long now_ms){
+        switch(state){
+            case State::COMMAND:
+                command = (char)c;
+                startedAt = now_ms;
+                if(c == PARSER_FRAME_START){
+                    received = 0;
+                    state = State::FRAME;
+                    return ParseResult::NONE;
+                }
+                if(c != 0 && strchr(numberCommands, c)){
+                    number = 0;
+                    digits = 0;
+                    state = State::NUMBER;
+                    return ParseResult::NONE;
+                }
+                return ParseResult::COMMAND;
+
+            case State::NUMBER:
+                if(c == '!'){
+                    state = State::COMMAND;
+                    return ParseResult::NUMBER; // No digits at all reads as 0
+                }
+                if(c >= '0' && c <= '9' && digits < PARSER_MAX_DIGITS){
+                    number = number * 10 + (c - '0');
+                    digits++;
+                    return ParseResult::NONE;
+                }
+                state = State::COMMAND;
+                return ParseResult::BAD_NUMBER;
+
+            case State::FRAME:
+                frame[received++] = c;
+                if(received == 1 && c > MAX_PAYLOAD){
+                    state = State::COMMAND;
+                    return ParseResult::FRAME_TOO_LONG;
+                }
+                if(received < 4 + frame[0])
+                    return ParseResult::NONE;
+
+                state = State::COMMAND;
+                if(crc8(frame, 3 + frame[0]) != frame[3 + frame[0]])
+                    return ParseResult::BAD_CRC;
+                return ParseResult::FRAME;
+        }
+        return ParseResult::NONE;
+    }
+
+    // Gives up on a command whose rest didn't arrive in time, call it every loop
+    ParseResult poll(unsigned long now_ms){
+        if(state == State::COMMAND)
+            return ParseResult::NONE;
+
+        unsigned long timeout_ms = state == State::FRAME ? frameTimeoutMs : numberTimeoutMs;
+        if(now_ms - startedAt < timeout_ms)
+            return ParseResult::NONE;
+
+        state = State::COMMAND;
+        return ParseResult::TIMEOUT;
+    }
+};
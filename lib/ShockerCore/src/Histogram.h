@@ -0,0 +1,40 @@
+// Fixed bucket histogram for timings measured on the device. Recording a value is a few shifts and an increment,
+// so it can sit on the hot path of the AVR loop.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Bucket i counts the values with i significant bits: 0 in bucket 0, 1 in bucket 1, 2 to 3 in bucket 2, 4 to 7 in
+// bucket 3 and so on. The last bucket also takes everything larger. A count that would pass 0xFFFF halves all of them,
+// so a histogram recorded every loop keeps the shape of the recent values instead of filling up.
+template <uint8_t BUCKETS> class Histogram {
+public:
+    uint16_t counts[BUCKETS] = {};
+
+    void record(uint32_t value){
+        uint8_t bucket = 0;
+        while(value != 0 && bucket < BUCKETS - 1){
+            value >>= 1;
+            bucket++;
+        }
+        if(counts[bucket] == 0xFFFF){
+            for(uint8_t i = 0; i < BUCKETS; i++){
+                counts[i] >>= 1;
+            }
+        }
+        counts[bucket]++;
+    }
+    void clear(){
+        memset(counts, 0, sizeof(counts));
+    }
+
+    // Writes the counts low byte first, returns the end of what was written
+    uint8_t *serialize(uint8_t *out) const {
+        for(uint8_t i = 0; i < BUCKETS; i++){
+            *out++ = counts[i] & 0xFF;
+            *out++ = counts[i] >> 8;
+        }
+        return out;
+    }
+};
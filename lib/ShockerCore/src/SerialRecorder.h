@@ -0,0 +1,80 @@
+// RAM ring of the bytes read from the serial port, so an incident can be replayed on the host. Bytes that arrive back to
+// back, like the bytes of one command, are kept as one burst with the millis() of the first one. The oldest bursts
+// make room for new ones.
+#pragma once
+
+#include <stdint.h>
+
+// Each burst is stored as millis() (4 bytes, low byte first), its length and its bytes. A byte joins the open burst
+// if it comes within MAX_GAP_MS of the burst's start and the burst has less than MAX_BURST bytes.
+template <uint16_t SIZE> class SerialRecorder {
+public:
+    static constexpr uint8_t MAX_BURST = 32;
+    static constexpr uint8_t MAX_GAP_MS = 5; // A 32 byte frame takes 2.8 ms at 115200 baud
+    static_assert(SIZE >= 2 * (5 + MAX_BURST), "Room for at least two full bursts");
+
+    // Adds a byte read at now_ms
+    void add(uint8_t c, unsigned long now_ms){
+        if(isBurstOpen && (ring[burstLength] == MAX_BURST || now_ms - burstMs > MAX_GAP_MS)){
+            isBurstOpen = false;
+        }
+        if(isBurstOpen){
+            makeRoom(1); // Drops the open burst when it is the oldest and the ring is full
+        }
+        if(!isBurstOpen){
+            makeRoom(5 + 1);
+            for(uint8_t i = 0; i < 4; i++){
+                push((now_ms >> (8 * i)) & 0xFF);
+            }
+            burstLength = (start + used) % SIZE;
+            push(0);
+            burstMs = now_ms;
+            isBurstOpen = true;
+        }
+        push(c);
+        ring[burstLength]++;
+    }
+
+    // Calls f(ms, bytes, length) for every burst, oldest first
+    template <typename F> void forEachBurst(F f) const {
+        uint8_t bytes[MAX_BURST];
+        for(uint16_t offset = 0; offset < used; ){
+            unsigned long ms = 0;
+            for(uint8_t i = 0; i < 4; i++){
+                ms |= (unsigned long)at(offset + i) << (8 * i);
+            }
+            uint8_t length = at(offset + 4);
+            for(uint8_t i = 0; i < length; i++){
+                bytes[i] = at(offset + 5 + i);
+            }
+            f(ms, bytes, length);
+            offset += 5 + length;
+        }
+    }
+
+private:
+    uint8_t ring[SIZE];
+    uint16_t start = 0;       // Index of the oldest burst
+    uint16_t used = 0;        // Bytes from start on that hold bursts
+    uint16_t burstLength = 0; // Index of the open burst's length byte
+    unsigned long burstMs = 0;
+    bool isBurstOpen = false;
+
+    uint8_t at(uint16_t offset) const {
+        return ring[(start + offset) % SIZE];
+    }
+    void push(uint8_t c){
+        ring[(start + used) % SIZE] = c;
+        used++;
+    }
+    void makeRoom(uint16_t bytes){
+        while(SIZE - used < bytes){
+            if(isBurstOpen && (start + 4) % SIZE == burstLength){
+                isBurstOpen = false;
+            }
+            uint16_t oldest = 5 + at(4);
+            start = (start + oldest) % SIZE;
+            used -= oldest;
+        }
+    }
+};
@@ -0,0 +1,2212 @@
+// Firmware core shared by the shocker boards. A board's main.cpp describes its hardware in a traits struct and
+// instantiates ShockerCore with it, every difference between the boards is an `if constexpr` on the traits,
+// so nothing a board doesn't have is compiled into it.
+//
+// A board drives one or more shocker units, each one a channel with its own ShockerChannel: state, power,
+// calibration, ramp, command queue and running pattern. ShockerCore owns the channels, the command parser
+// and the pattern slots they share, and ticks every channel each loop so their ramps run side by side.
+//
+// Traits every board defines (see the two main.cpp files):
+//   NAME                                               Board name in the ready banner
+//   CHANNELS                                           ShockerPins of each unit wired to the board, channel 0 first
+//   POWER_ADJUST_ON_TIME_MS, POWER_ADJUST_OFF_TIME_MS  Button press timing until one is set, see Press timing
+//   POWER_COMMAND_TIMEOUT_MS                           Time allowed for the rest of a P<n>! or D<ms>!
+//   DUAL_RANGE                                         Low range 0 to LOW_RANGE_TOP and a high range up to 99,
+//                                                      needs PIN_RANGE_LOW, PIN_RANGE_HIGH, LOW_RANGE_TOP,
+//                                                      RANGE_RELEASE_TIME_MS and RANGE_SETTLE_TIME_MS, one channel only
+//   HOMING                                             HomingStrategy::WALK, or HomingStrategy::HOLD which needs
+//                                                      CALIBRATION_HOLD_TIME_S, CALIBRATION_MARGIN_STEPS and
+//                                                      CALIBRATION_RELEASE_TIME_MS and adds the C and V commands
+//   SPLIT_TASKS                                        Serial and actuator run in different tasks, see the hooks
+//   PATTERN_SLOTS, PATTERN_MAX_SIZE                    Pattern programs kept in RAM and the bytes each may take
+//   PATTERN_STORAGE                                    Patterns are also kept in non-volatile storage, see the hooks
+//   UART_WAKE                                          The board sleeps through the first bytes after a quiet spell,
+//                                                      the host sends a wake byte first (see Handshake)
+//   SERIAL_RX_CAPACITY                                 What Serial.available() returns once the RX buffer is full,
+//                                                      see Flow control
+//
+// Hooks every board defines as static functions of the traits struct:
+//   startPulseTimer(channel, length_ms)                The timer releases the channel's shocker and sets its pulseEnded
+//   stopPulseTimer(channel)
+//   startPressTimer(channel, first_ms)                 Calls the channel's pressTimerEdge() first_ms from now, then as
+//                                                      many ms after each call as it returns, until it returns 0
+//   readStorage(channel, data, size)                   Non-volatile storage for the calibration of a channel,
+//   writeStorage(channel, data, size)                  read is false if empty
+//   readTiming(channel, data, size)                    Non-volatile storage for the press timing of a channel,
+//   writeTiming(channel, data, size)                   read is false if empty
+//   handleCommand(c)                                   Board specific single character commands, false if unknown
+// and with SPLIT_TASKS:
+//   submit(command)                                    Hands a parsed command to the actuator task
+//   nextRequest(command)                               Takes the next one on the actuator task, false if none
+//   write(data, length)                                Output of the actuator task, one call per line or frame
+// and with PATTERN_STORAGE:
+//   readPattern(slot, data, size)                      Returns the length of the stored program, 0 if none
+//   writePattern(slot, data, length)
+// and with SHOCKER_METRICS:
+//   metricsClock(), METRICS_CLOCK_PER_US               Fastest clock of the core running the actuator side
+#pragma once
+
+#include <Arduino.h>
+#include <CommandParser.h>
+#include <Histogram.h>
+#include <SerialRecorder.h>
+
+// Config
+    #define FIRMWARE_VERSION_MAJOR 1       // Changes when the host has to change with it
+    #define FIRMWARE_VERSION_MINOR 3       // Changes when something is added
+    #define COMMAND_QUEUE_SIZE 8           // Commands that can wait behind a running ramp. Back to back power commands share one slot.
+    #define PULSE_MAX_TIME_MS 30000        // Longest pulse a D<ms>! command can ask for.
+    #define CALIBRATION_SAVE_DELAY_MS 5000 // How long the power has to stay idle before it is stored.
+    #define CALIBRATION_LAYOUT 0x52        // Marks a valid record, change it when StoredCalibration changes.
+    #define STATUS_INTERVAL_MS 250         // Shortest gap between status frames that only carry a new power level.
+    #define PATTERN_LOOP_DEPTH 2           // LOOPs a pattern can nest
+    #define PATTERN_STEPS_PER_TICK 16      // Pattern instructions run per loop before everything else gets a turn
+    #define CREDIT_REPORT_BYTES 32         // Bytes read before a credit report goes out in the middle of a burst
+    #define CREDIT_SLACK 2                 // RX buffer bytes kept back for the wake bytes of a UART_WAKE host
+    #ifndef SHOCKER_METRICS
+        #define SHOCKER_METRICS 1          // Latency and timing histograms, build with -DSHOCKER_METRICS=0 to leave them out
+    #endif
+    #ifndef SHOCKER_RECORDER
+        #define SHOCKER_RECORDER 0         // Bytes of RAM that keep the serial input for a replay, see Recorder. 0 leaves it out.
+    #endif
+
+
+// Framed protocol
+// Optional binary alternative to the single character commands, both can be mixed on the same link.
+// Frame: 0xA5, payload length, opcode, sequence, payload, CRC-8 (poly 0x07) over everything after the 0xA5.
+// An accepted command is answered with FRAME_ACCEPTED and later FRAME_COMPLETED carrying its sequence,
+// a command that can't be run only gets FRAME_REJECTED. Text status lines are sent as before.
+// Bits 4 to 6 of a command opcode select the channel, so the opcodes below address channel 0. The replies carry the
+// sequence only, the host knows the channel from it.
+    #define FRAME_START PARSER_FRAME_START
+    #if SHOCKER_METRICS
+        #define FRAME_MAX_REPLY METRICS_REPORT_SIZE
+    #else
+        #define FRAME_MAX_REPLY SNAPSHOT_MAX_SIZE // Longest payload the firmware sends, commands can be longer (see PATTERN_MAX_SIZE)
+    #endif
+    #define FRAME_TIMEOUT_MS 100   // Maximum time to wait for the rest of a frame
+    #define NO_SEQUENCE -1         // Sequence of commands that came in as ASCII
+    #define FRAME_CHANNEL_SHIFT 4
+    #define FRAME_OPCODE_MASK 0x0F
+    #define FRAME_MAX_CHANNELS 8
+
+    #define FRAME_SHOCK_START 0x01
+    #define FRAME_SHOCK_STOP 0x02
+    #define FRAME_SET_POWER 0x03   // Payload: power level
+    #define FRAME_CALIBRATE 0x04   // HOLD boards only. Re-home the power and return to the current level. Optional payload: 1 for the quick verify
+    #define FRAME_SHOCK_PULSE 0x05 // Payload: pulse length in ms, low byte first. Completes when the pulse ends.
+    #define FRAME_PATTERN_UPLOAD 0x06 // Payload: slot, program. Replaces the program in the slot.
+    #define FRAME_PATTERN_START 0x07  // Payload: slot, optional seed (low byte first) and flags. Completes when the pattern ends.
+    #define FRAME_METRICS 0x08        // Answered with FRAME_METRICS_REPORT only, see Metrics
+    #define FRAME_METRICS_RESET 0x09
+    #define FRAME_SNAPSHOT 0x0A       // Answered with FRAME_SNAPSHOT_REPORT only, see Handshake
+    #define FRAME_SET_TIMING 0x0B     // Payload: press on ms, press off ms. Stored, see Press timing.
+    #define FRAME_TIMING_SWEEP 0x0C   // Payload: first ms, last ms, step ms, presses. Completes when the sweep ends.
+    #define FRAME_ACCEPTED 0x80
+    #define FRAME_COMPLETED 0x81   // Payload: status, power level
+    #define FRAME_REJECTED 0x82    // Payload: status
+    #define FRAME_METRICS_REPORT 0x83 // Payload: see Metrics
+    #define FRAME_SNAPSHOT_REPORT 0x84 // Payload: see Handshake
+    #define FRAME_SWEEP_REPORT 0x85    // Payload: see Press timing
+    #define FRAME_CREDIT 0x86          // Payload: see Flow control
+
+    #define FRAME_STATUS_OK 0
+    #define FRAME_STATUS_SUPERSEDED 1     // A newer power or shock command took over
+    #define FRAME_STATUS_CANCELLED 2      // A start dropped or a pulse cut short by a stop
+    #define FRAME_STATUS_INVALID 3        // Bad payload
+    #define FRAME_STATUS_BAD_CRC 4
+    #define FRAME_STATUS_QUEUE_FULL 5
+    #define FRAME_STATUS_UNKNOWN_OPCODE 6
+    #define FRAME_STATUS_UNKNOWN_CHANNEL 7
+
+
+// Channels
+// The ASCII commands go to the channel selected with U<n>!, channel 0 after a reset. The status lines of a channel
+// other than 0 start with its number and a colon, "2:P40!" and "2:B", so a single channel board reads as it always has.
+    #define NO_PIN 0xFF // ShockerPins::led of a channel without an LED
+
+
+// Patterns
+// Programs the firmware runs on its own, so the timing of a random session doesn't depend on the host or the USB link.
+// A program is a list of instructions, an opcode followed by its operands, 16 bit operands low byte first.
+// The last instruction is PATTERN_END. Power changes don't wait, PULSE waits for the pulse to end (after any ramp in
+// front of it) and WAIT waits from where it is reached. Random operands are drawn from a PRNG seeded by the start command,
+// so a seed always gives the same session. Any other command from the host to the same channel ends the running pattern.
+// The slots are shared by the channels, each channel runs a pattern of its own.
+    #define PATTERN_END 0x00          // Waits for the running ramp or pulse, then completes the pattern
+    #define PATTERN_POWER 0x01        // level
+    #define PATTERN_POWER_RANDOM 0x02 // min level, max level
+    #define PATTERN_PULSE 0x03        // ms (16 bit)
+    #define PATTERN_PULSE_RANDOM 0x04 // min ms, max ms (16 bit each)
+    #define PATTERN_WAIT 0x05         // Units of PATTERN_WAIT_UNIT_MS (16 bit)
+    #define PATTERN_WAIT_RANDOM 0x06  // min, max units (16 bit each)
+    #define PATTERN_LOOP 0x07         // Offset of the first instruction of the loop, times to run it (0 runs it forever)
+    #define PATTERN_WAIT_UNIT_MS 10
+
+    #define PATTERN_FLAG_PREPOSITION 0x01 // A WAIT followed by a power change starts the ramp when the wait starts
+
+
+// Handshake
+// Once it takes commands after a reset, the firmware sends one text line:
+//   Ready ciab-shocker <major>.<minor> board=<NAME> channels=<n> ranges=<n> patterns=<slots> caps=<list>
+// caps is a comma separated list out of frames, snapshot, calibrate, metrics, pattern-storage, timing, uart-wake,
+// recorder and credit. With uart-wake, a host that hasn't written for a second sends "\n\n" and waits a few ms before the command.
+// A host that opens the port without resetting the board sends FRAME_SNAPSHOT instead, the answer tells it the board is
+// up and where the channel in the opcode stands. FRAME_SNAPSHOT_REPORT payload:
+//   version major, version minor, channel count, state (0 idle, 1 busy, 2 shocking), SNAPSHOT_FLAG_* flags,
+//   uptime in ms (32 bit, low byte first), selected range, range count, then for each range its power level and
+//   1 if that level has been homed, 0 if not, then (since 1.1) press on ms and press off ms, then (since 1.3) the
+//   credit and the bytes read up to the end of the snapshot request (16 bit each, low byte first), see Flow control
+    #define SNAPSHOT_FLAG_STORED 0x01  // The calibration in storage matches the current one
+    #define SNAPSHOT_FLAG_RAMP 0x02    // A ramp is running
+    #define SNAPSHOT_FLAG_PATTERN 0x04 // A pattern is running
+    #define SNAPSHOT_MAX_SIZE (17 + 2 * 2) // With two ranges
+
+
+// Flow control
+// Bytes that come in while the RX buffer is full are lost. A host that keeps no more bytes on their way to the board
+// than the credit, SERIAL_RX_CAPACITY less CREDIT_SLACK, never overflows it however long a loop takes. The board counts
+// the bytes it has read since boot (16 bit, wrapping) and sends the count in FRAME_CREDIT, sequence 0:
+//   bytes read (16 bit, low byte first)
+// once CREDIT_REPORT_BYTES more have been read, and whenever it has read everything that came in. It only starts once a
+// frame came in since boot, so a serial monitor or a host that only reads text lines never gets one. The host may
+// then send up to credit - (bytes sent - bytes read) more. The snapshot report carries the credit and the count up to
+// the end of the snapshot request, so the host lines its own count up with the board's after connecting.
+// Line endings between commands aren't counted, so the wake bytes of a UART_WAKE board, which may sleep through them,
+// don't put the counts out of step.
+
+
+// Errors
+// A command that can't be read or run gets a text line with an error code instead of a sentence (since 1.2), so the
+// strings don't take RAM on the Nano:
+//   E<code>, followed by the command letter for ERROR_NUMBER_FORMAT and ERROR_NUMBER_TIMEOUT, e.g. "E6P"
+// Framed commands are answered with FRAME_REJECTED as before.
+    #define ERROR_UNKNOWN_COMMAND 1
+    #define ERROR_POWER_RANGE 2    // P<n>! above 99
+    #define ERROR_PULSE_RANGE 3    // D<ms>! outside 1 to PULSE_MAX_TIME_MS
+    #define ERROR_PATTERN_SLOT 4   // R<n>! without such a slot
+    #define ERROR_CHANNEL 5        // U<n>! without such a channel
+    #define ERROR_NUMBER_FORMAT 6  // Invalid character, or more digits than the command takes
+    #define ERROR_NUMBER_TIMEOUT 7 // The rest of the number didn't come within POWER_COMMAND_TIMEOUT_MS
+    #define ERROR_FRAME_TOO_LONG 8
+    #define ERROR_FRAME_TIMEOUT 9  // The rest of the frame didn't come within FRAME_TIMEOUT_MS
+    #define ERROR_QUEUE_FULL 10    // COMMAND_QUEUE_SIZE commands already wait behind the running ramp
+    #define ERROR_PATTERN_EMPTY 11 // R<n>! on a slot without a program
+
+
+// Metrics
+// Histograms of the timings that matter to the host, kept on the device and sent on request. Each one has
+// METRICS_BUCKETS 16 bit counts (see Histogram.h), so bucket i holds the values of i significant bits. The loop is
+// timed every pass, its counts are only good for proportions.
+// FRAME_METRICS_REPORT payload, counts low byte first:
+//   Command to edge, us   From reading the last byte of a start, pulse or stop to the shocker pin changing
+//   Ramp, ms              From a power command starting its ramp to the target being reached, homing included
+//   Loop, us              One pass of the actuator side, every channel and the requests
+//   RX overflows          Times the serial RX buffer was found full, bytes were probably lost (16 bit)
+// All of them count from boot or the last FRAME_METRICS_RESET.
+    #define METRICS_BUCKETS 16
+    #define METRICS_REPORT_SIZE (3 * METRICS_BUCKETS * 2 + 2)
+
+
+// Recorder
+// A debug build with -DSHOCKER_RECORDER=<bytes> keeps the serial input in RAM (see SerialRecorder.h) and answers L with
+// all of it, oldest first, one line per burst of bytes that came back to back, then "@end":
+//   @<millis() of the first byte> <bytes in hex>
+// The native program (see ArduinoSim.cpp) replays such lines, or the capture the server writes, on the host.
+
+
+// Press timing
+// How long a power button is held down and released for each step. The board's POWER_ADJUST_ON_TIME_MS and
+// POWER_ADJUST_OFF_TIME_MS until FRAME_SET_TIMING sets a timing for the channel, which is stored and used from then on.
+// Homing walks and the calibration holds keep to the set timing.
+// FRAME_TIMING_SWEEP finds the fastest timing a unit still follows. For every on and off time from first to last ms
+// (both in steps of step ms) it homes to the bottom of the range with the set timing, presses increase the given
+// number of times with the timing being tried, and sends FRAME_SWEEP_REPORT with the sweep's sequence and a text line:
+//   on ms, off ms, presses, ms the presses took (16 bit, low byte first)
+// It then waits SWEEP_OBSERVE_MS, so whoever watches the unit's display can check it shows the bottom plus the
+// presses. A sweep ends homed to the bottom of the range, any command to the channel ends it early.
+    #define PRESS_TIME_MAX_MS 250
+    #define SWEEP_OBSERVE_MS 2000
+    #define TIMING_LAYOUT 0x54 // Marks a valid StoredTiming
+
+
+// Types
+    enum class ShockerState {
+        IDLE,
+        BUSY,
+        SHOCKING,
+    };
+
+    enum class HomingStrategy : uint8_t {
+        WALK, // Press decrease as many times as the range is long, the counter starts at the top
+        HOLD, // Hold a power button down long enough to run into the end stop
+    };
+
+    struct ShockerPins {
+        uint8_t shocker;
+        uint8_t increasePower;
+        uint8_t decreasePower;
+        uint8_t led; // NO_PIN if the channel has none
+    };
+
+    enum class CommandType : uint8_t {
+        SHOCK_START,
+        SHOCK_PULSE,
+        SET_POWER,
+        CALIBRATE,          // HOLD boards only
+        VERIFY_CALIBRATION, // HOLD boards only
+        SHOCK_STOP,         // Run as soon as it is handled, never queued
+        REJECT,             // Only carries a reply, so it stays in order with the others
+        PATTERN_UPLOAD,     // Run as soon as it is handled
+        PATTERN_START,      // Run as soon as it is handled
+        METRICS,            // Run as soon as it is handled
+        METRICS_RESET,      // Run as soon as it is handled
+        SNAPSHOT,           // Run as soon as it is handled
+        SET_TIMING,         // Run as soon as it is handled
+        TIMING_SWEEP,       // Run as soon as it is handled
+    };
+    struct Command {
+        CommandType type;
+        int8_t powerLevel;    // Target for SET_POWER, slot of the PATTERN commands, presses of a TIMING_SWEEP
+        uint16_t pulseTimeMs; // Length of a SHOCK_PULSE, program length of a PATTERN_UPLOAD, seed of a PATTERN_START,
+                              // RX overflows of a METRICS, on ms | off ms << 8 of a SET_TIMING, first ms | last ms << 8
+                              // of a TIMING_SWEEP
+        int16_t sequence;     // Frame sequence to complete, NO_SEQUENCE for ASCII commands
+        uint8_t status;       // Reply of a REJECT, flags of a PATTERN_START, step ms of a TIMING_SWEEP
+        uint8_t channel;
+        #if SHOCKER_METRICS
+            uint32_t receivedUs; // micros() when its last byte was read, 0 if it didn't come from the host
+        #endif
+    };
+
+    struct ShockerMetrics {
+        Histogram<METRICS_BUCKETS> edgeLatencyUs;
+        Histogram<METRICS_BUCKETS> rampMs;
+        Histogram<METRICS_BUCKETS> loopUs;
+
+        void clear(){
+            edgeLatencyUs.clear();
+            rampMs.clear();
+            loopUs.clear();
+        }
+    };
+
+
+// One shocker unit: everything on the actuator side that a board has once per channel.
+template <typename Board> class ShockerChannel {
+public:
+    static constexpr uint8_t RANGE_COUNT = Board::DUAL_RANGE ? 2 : 1;
+    static constexpr bool HOLD_HOMING = Board::HOMING == HomingStrategy::HOLD;
+
+    // State
+        uint8_t channel = 0; // Index in Board::CHANNELS
+        ShockerState currentState = ShockerState::IDLE;
+
+        int powerLevels[RANGE_COUNT];   // Counter of each range, index 1 is the high range
+        bool isCalibrated[RANGE_COUNT]; // Set once the range counter has been homed
+        uint8_t range = 0;              // Selected range
+
+        // Actuator
+        // The buttons are sequenced by actuatorTick() instead of blocking in delay(),
+        // so serial is still read (and a stop still handled) while a ramp is running.
+            enum class ActuatorStep {
+                IDLE,
+                RANGE_RELEASE,       // Old range selector released, waiting before engaging the new one
+                RANGE_SETTLE,        // New range selector engaged, waiting for it to settle
+                CALIBRATION_RELEASE, // Power button released before the calibration hold
+                CALIBRATION_HOLD,    // Power button held down until the power is surely at the end stop
+                PRESS_TRAIN,         // The press timer is running the presses, see Press train
+            };
+            ActuatorStep actuatorStep = ActuatorStep::IDLE;
+            unsigned long actuatorStepStartUs = 0;  // micros() when the current step started
+            unsigned long actuatorStepLengthUs = 0; // How long the current step lasts
+
+            enum class Homing : uint8_t {
+                IF_NEEDED, // Only when the range counter isn't known
+                FULL,      // HOLD: hold long enough to cross the whole range
+                VERIFY,    // HOLD: hold from the current power level to the end stop plus a margin
+            };
+            int targetPowerLevel = -1;      // Power level the running ramp is heading to, -1 when no ramp is running
+            uint8_t targetRange = 0;        // Range the running ramp is heading to
+            uint8_t switchingRange = 0;     // Range whose selector the running range switch engages
+            Homing targetHoming = Homing::IF_NEEDED; // Homing the running ramp asked for and hasn't started yet
+            bool isHoming = false;          // The running ramp is still on its way to an end of the range
+            int homingDirection = -1;       // -1 while homing to the bottom of the range, +1 while homing to the top
+            unsigned long homingHoldMs = 0; // HOLD: how long the homing button is held
+            int pressDirection = 0;         // +1 while pressing increase, -1 while pressing decrease
+            int16_t targetSequence = NO_SEQUENCE; // Frame sequence the running ramp completes
+
+        // Press train
+        // The presses toward a power level run from the board's press timer, so their timing doesn't depend on the loop
+        // and the loop is free for serial in the meantime. pressTimerEdge() only writes the pin and counts, each counter
+        // has a single writer. The loop applies the finished presses to the power level and lowers the wanted count when
+        // a new target needs fewer presses; a longer way or a new direction gets a new train once this one is done.
+            volatile uint8_t trainPressesWanted = 0;  // Written by the loop
+            volatile uint8_t trainPressesStarted = 0; // Written by the timer
+            volatile uint8_t trainPressesDone = 0;    // Written by the timer, counts a press once its off time is over
+            volatile bool isTrainPressing = false;    // Written by the timer, the button is held down
+            volatile bool trainEnded = false;         // Written by the timer
+            uint8_t trainOnMs = 0;
+            uint8_t trainOffMs = 0;
+            uint8_t trainPressesCounted = 0;          // trainPressesDone already applied to the power level
+            int trainStartLevel = 0;                  // Power level when the train started
+
+        // Command queue
+        // Commands that have to wait for the running ramp. A stop never goes through here, it is executed as soon as it is handled.
+            Command commandQueue[COMMAND_QUEUE_SIZE];
+            uint8_t commandQueueHead = 0;  // Index of the oldest command
+            uint8_t commandQueueCount = 0; // Number of commands waiting
+
+        // Timed pulse
+        // A D<ms>! pulse is ended by a board timer, so its length doesn't depend on the loop or on the host getting a stop through.
+            volatile bool pulseEnded = false;    // Set by the timer once it has released the shocker
+            bool isPulsing = false;              // A pulse is running or its end hasn't been reported yet
+            int16_t pulseSequence = NO_SEQUENCE; // Frame sequence the running pulse completes
+
+        // Stored calibration
+        // The power levels and range are kept in non-volatile storage so a reboot (or the DTR reset when the host
+        // connects) doesn't home again. A ramp first marks the record invalid, it is rewritten once the power has
+        // been idle for a while, so a burst of power changes costs two writes and a reboot mid-ramp falls back to homing.
+            struct StoredCalibration {
+                uint8_t layout;      // CALIBRATION_LAYOUT, 0 while a ramp is changing the power
+                uint16_t generation; // Counts the saves
+                int8_t powerLevels[RANGE_COUNT];
+                uint8_t range;
+                bool isCalibrated[RANGE_COUNT];
+                uint8_t crc;         // crc8() of everything before it
+            };
+            uint16_t calibrationGeneration = 0;
+            bool isCalibrationStored = false;     // The storage holds a valid record of the current state
+            unsigned long calibrationChangedAt = 0; // millis() when the power last changed
+
+        // Status frames
+        // The power and the state are reported together, built in statusBuffer so a report costs one write.
+        // A state change is sent right away, the power steps of a running ramp at most once per STATUS_INTERVAL_MS.
+            char statusBuffer[12];          // "7:P99!\n" and "7:" with the state letter and its '\n'
+            bool isPowerDirty = false;      // The power changed since the last status frame
+            unsigned long statusSentAt = 0; // millis() of the last status frame
+
+        // Patterns
+        // Run from their slot by patternTick() on the actuator side, see Patterns above for the program format.
+        // The slots belong to ShockerCore, begin() points the channel at them.
+            enum class PatternStep : uint8_t {
+                IDLE,   // No pattern running
+                RUN,    // Running instructions
+                WAIT,   // In a WAIT
+                SETTLE, // Waiting for a PULSE to end
+                FINISH, // Reached the END, waiting for the ramp or pulse to end
+            };
+            const uint8_t (*patterns)[Board::PATTERN_MAX_SIZE] = nullptr;
+            const uint8_t *patternLengths = nullptr; // 0 for an empty slot
+            PatternStep patternStep = PatternStep::IDLE;
+            uint8_t patternSlot = 0;          // Slot of the running pattern
+            uint8_t patternPc = 0;            // Offset of the next instruction
+            uint8_t patternFlags = 0;
+            uint32_t patternRandom = 0;       // xorshift32 state
+            unsigned long patternWaitStartUs = 0; // micros() when the WAIT started
+            unsigned long patternWaitUs = 0;
+            uint8_t patternLoopPcs[PATTERN_LOOP_DEPTH];       // Offset of each LOOP that is running, innermost last
+            uint8_t patternLoopRemaining[PATTERN_LOOP_DEPTH]; // Runs left, 0 for a LOOP that runs forever
+            uint8_t patternLoopDepth = 0;
+            int16_t patternSequence = NO_SEQUENCE; // Frame sequence the running pattern completes
+
+        // Press timing
+        // See Press timing above, sweepTick() runs the sweep.
+            struct StoredTiming {
+                uint8_t layout; // TIMING_LAYOUT
+                uint8_t onMs;
+                uint8_t offMs;
+                uint8_t crc;    // crc8() of everything before it
+            };
+            enum class SweepStep : uint8_t {
+                IDLE,    // No sweep running
+                START,   // Waiting for the ramp or queued commands in front of it
+                HOME,    // Homing to the bottom of the range
+                PRESS,   // Pressing with the timing being tried
+                OBSERVE, // Showing the result on the unit
+                FINISH,  // Homing to the bottom after the last timing
+            };
+            uint8_t pressOnMs = Board::POWER_ADJUST_ON_TIME_MS;
+            uint8_t pressOffMs = Board::POWER_ADJUST_OFF_TIME_MS;
+            SweepStep sweepStep = SweepStep::IDLE;
+            uint8_t sweepFirstMs = 0;
+            uint8_t sweepLastMs = 0;
+            uint8_t sweepStepMs = 0;
+            uint8_t sweepPresses = 0;
+            uint8_t sweepOnMs = 0;           // Timing being tried
+            uint8_t sweepOffMs = 0;
+            unsigned long sweepStepAt = 0;   // millis() when the presses or the observation started
+            int16_t sweepSequence = NO_SEQUENCE; // Frame sequence the running sweep completes
+
+        // Metrics
+        // Shared by the channels, only the actuator side writes them.
+            #if SHOCKER_METRICS
+                static inline ShockerMetrics metrics;
+                unsigned long rampStartedAt = 0; // millis() when the running ramp started
+            #endif
+
+
+    // Ranges
+        static uint8_t rangeFor(int level){
+            if constexpr (Board::DUAL_RANGE){
+                return level > Board::LOW_RANGE_TOP ? 1 : 0;
+            } else {
+                return 0;
+            }
+        }
+        static int rangeBottom(uint8_t r){
+            if constexpr (Board::DUAL_RANGE){
+                return r == 1 ? Board::LOW_RANGE_TOP + 1 : 0;
+            } else {
+                return 0;
+            }
+        }
+        static int rangeTop(uint8_t r){
+            if constexpr (Board::DUAL_RANGE){
+                return r == 1 ? 99 : Board::LOW_RANGE_TOP;
+            } else {
+                return 99;
+            }
+        }
+        int currentPowerLevel(){
+            return powerLevels[range];
+        }
+        const ShockerPins &pins() const {
+            return Board::CHANNELS[channel];
+        }
+
+    // Reporting state
+        // Output of the actuator side, the parser side always writes to Serial
+        void writeOutput(const uint8_t *data, size_t length){
+            if constexpr (Board::SPLIT_TASKS){
+                Board::write(data, length);
+            } else {
+                Serial.write(data, length);
+            }
+        }
+        void writeOutput(const char *text){
+            writeOutput((const uint8_t *)text, strlen(text));
+        }
+        // Actuator side twin of ShockerCore::sendError(), see Errors
+        void reportError(uint8_t code){
+            char line[5];
+            uint8_t length = 0;
+            line[length++] = 'E';
+            appendNumber(line, length, code);
+            line[length++] = '\n';
+            writeOutput((const uint8_t *)line, length);
+        }
+
+        // Channels other than 0 put "<channel>:" in front of a status line
+        void writeChannelPrefix(uint8_t &length){
+            if(channel > 0){
+                statusBuffer[length++] = '0' + channel;
+                statusBuffer[length++] = ':';
+            }
+        }
+        // Sends "P<level>!" and the state letter as one write. The level is left out until it has been homed.
+        void sendStatus(){
+            uint8_t length = 0;
+            if(isCalibrated[range]){
+                int level = currentPowerLevel();
+                writeChannelPrefix(length);
+                statusBuffer[length++] = 'P';
+                if(level >= 10){
+                    statusBuffer[length++] = '0' + level / 10;
+                }
+                statusBuffer[length++] = '0' + level % 10;
+                statusBuffer[length++] = '!';
+                statusBuffer[length++] = '\n';
+            }
+            writeChannelPrefix(length);
+            switch(currentState){
+                case ShockerState::IDLE:     statusBuffer[length++] = 'B'; break;
+                case ShockerState::BUSY:     statusBuffer[length++] = 'C'; break;
+                case ShockerState::SHOCKING: statusBuffer[length++] = 'A'; break;
+            }
+            statusBuffer[length++] = '\n';
+
+            writeOutput((const uint8_t *)statusBuffer, length);
+            isPowerDirty = false;
+            statusSentAt = millis();
+        }
+        void setState(ShockerState state){
+            if(currentState == state)
+                return; // Pressing a button twice doesn't send a second frame
+
+            currentState = state;
+            sendStatus();
+        }
+        void reportStateIdle(){
+            setState(ShockerState::IDLE);
+        }
+        void reportStateBusy(){
+            setState(ShockerState::BUSY);
+        }
+        void reportStateShocking(){
+            setState(ShockerState::SHOCKING);
+        }
+        void reportPowerLevel(){
+            isPowerDirty = true;
+        }
+        // Sends the power steps of a running ramp, must be called every loop
+        void statusTick(){
+            if(isPowerDirty && millis() - statusSentAt >= STATUS_INTERVAL_MS){
+                sendStatus();
+            }
+        }
+
+    // Framed replies
+        void sendFrame(uint8_t opcode, uint8_t sequence, const uint8_t *payload, uint8_t length){
+            uint8_t frame[5 + FRAME_MAX_REPLY];
+            frame[0] = FRAME_START;
+            frame[1] = length;
+            frame[2] = opcode;
+            frame[3] = sequence;
+            for(uint8_t i = 0; i < length; i++){
+                frame[4 + i] = payload[i];
+            }
+            frame[4 + length] = crc8(&frame[1], 3 + length);
+            writeOutput(frame, 5 + length);
+        }
+        // The report functions do nothing for ASCII commands
+        void reportAccepted(int16_t sequence){
+            if(sequence == NO_SEQUENCE)
+                return;
+            sendFrame(FRAME_ACCEPTED, sequence, nullptr, 0);
+        }
+        void reportCompleted(int16_t sequence, uint8_t status){
+            if(sequence == NO_SEQUENCE)
+                return;
+            uint8_t payload[2] = { status, (uint8_t)currentPowerLevel() };
+            sendFrame(FRAME_COMPLETED, sequence, payload, 2);
+        }
+        void reportRejected(int16_t sequence, uint8_t status){
+            if(sequence == NO_SEQUENCE)
+                return;
+            sendFrame(FRAME_REJECTED, sequence, &status, 1);
+        }
+
+    // Metrics
+        static uint32_t receivedAt(const Command &command){
+            #if SHOCKER_METRICS
+                return command.receivedUs;
+            #else
+                return 0;
+            #endif
+        }
+        // Called right after a command from the host moved the shocker pin
+        void recordEdgeLatency(uint32_t received_us){
+            #if SHOCKER_METRICS
+                if(received_us != 0){
+                    metrics.edgeLatencyUs.record(micros() - received_us);
+                }
+            #endif
+        }
+
+    // Stored calibration
+        void writeCalibration(uint8_t layout){
+            StoredCalibration stored = {};
+            stored.layout = CALIBRATION_LAYOUT;
+            stored.generation = calibrationGeneration;
+            for(uint8_t r = 0; r < RANGE_COUNT; r++){
+                stored.powerLevels[r] = powerLevels[r];
+                stored.isCalibrated[r] = isCalibrated[r];
+            }
+            stored.range = range;
+            stored.crc = crc8((const uint8_t *)&stored, offsetof(StoredCalibration, crc));
+            stored.layout = layout; // The CRC stays that of the valid record, so invalidating only changes this byte
+            Board::writeStorage(channel, &stored, sizeof(stored));
+        }
+        void loadCalibration(){
+            StoredCalibration stored = {};
+            bool found = Board::readStorage(channel, &stored, sizeof(stored));
+            calibrationGeneration = found ? stored.generation : 0;
+
+            isCalibrationStored = found && stored.layout == CALIBRATION_LAYOUT
+                && stored.crc == crc8((const uint8_t *)&stored, offsetof(StoredCalibration, crc))
+                && stored.range < RANGE_COUNT;
+            for(uint8_t r = 0; r < RANGE_COUNT; r++){
+                if(stored.powerLevels[r] < rangeBottom(r) || stored.powerLevels[r] > rangeTop(r))
+                    isCalibrationStored = false;
+            }
+
+            for(uint8_t r = 0; r < RANGE_COUNT; r++){
+                powerLevels[r] = isCalibrationStored ? stored.powerLevels[r] : rangeBottom(r);
+                isCalibrated[r] = isCalibrationStored && stored.isCalibrated[r];
+            }
+            range = isCalibrationStored ? stored.range : 0;
+        }
+        void saveCalibration(){
+            calibrationGeneration++;
+            writeCalibration(CALIBRATION_LAYOUT);
+            isCalibrationStored = true;
+        }
+        // Called before a ramp touches the power, a reboot before the next save has to home again
+        void invalidateCalibration(){
+            calibrationChangedAt = millis();
+            if(!isCalibrationStored)
+                return;
+
+            writeCalibration(0);
+            isCalibrationStored = false;
+        }
+        // Saves a changed calibration once nothing has happened for CALIBRATION_SAVE_DELAY_MS, must be called every loop.
+        // Waiting for idle keeps the slow EEPROM and flash writes away from ramps and shocks.
+        void calibrationTick(){
+            if(isCalibrationStored || currentState != ShockerState::IDLE)
+                return;
+            if(millis() - calibrationChangedAt < CALIBRATION_SAVE_DELAY_MS)
+                return;
+
+            saveCalibration();
+        }
+
+    // Timed pulse
+        // Reports the end of the pulse, a pulse the timer already ended counts as done even if a stop got here first
+        void completePulse(uint8_t status){
+            if(!isPulsing)
+                return;
+
+            isPulsing = false;
+            reportCompleted(pulseSequence, pulseEnded ? FRAME_STATUS_OK : status);
+            pulseSequence = NO_SEQUENCE;
+            pulseEnded = false;
+        }
+
+    // Press timing
+        void loadPressTiming(){
+            StoredTiming stored = {};
+            bool found = Board::readTiming(channel, &stored, sizeof(stored));
+            if(!found || stored.layout != TIMING_LAYOUT || stored.crc != crc8((const uint8_t *)&stored, offsetof(StoredTiming, crc)))
+                return; // Keeps the board's timing
+            if(stored.onMs == 0 || stored.offMs == 0 || stored.onMs > PRESS_TIME_MAX_MS || stored.offMs > PRESS_TIME_MAX_MS)
+                return;
+
+            pressOnMs = stored.onMs;
+            pressOffMs = stored.offMs;
+        }
+        void setPressTiming(uint8_t on_ms, uint8_t off_ms){
+            pressOnMs = on_ms;
+            pressOffMs = off_ms;
+
+            StoredTiming stored = {};
+            stored.layout = TIMING_LAYOUT;
+            stored.onMs = on_ms;
+            stored.offMs = off_ms;
+            stored.crc = crc8((const uint8_t *)&stored, offsetof(StoredTiming, crc));
+            Board::writeTiming(channel, &stored, sizeof(stored));
+        }
+
+    // Timing sweep
+        bool isSweepRunning(){
+            return sweepStep != SweepStep::IDLE;
+        }
+        bool isSweepPressing(){
+            return sweepStep == SweepStep::PRESS && !isHoming;
+        }
+
+        void startSweep(uint8_t first_ms, uint8_t last_ms, uint8_t step_ms, uint8_t presses, int16_t sequence){
+            sweepFirstMs = first_ms;
+            sweepLastMs = last_ms;
+            sweepStepMs = step_ms;
+            sweepPresses = presses;
+            sweepOnMs = first_ms;
+            sweepOffMs = first_ms;
+            sweepSequence = sequence;
+            sweepStep = SweepStep::START;
+            sweepTick();
+        }
+        // A sweep ended after the first presses leaves the counter in doubt, the next ramp homes first
+        void endSweep(uint8_t status){
+            if(!isSweepRunning())
+                return;
+
+            if(sweepStep == SweepStep::PRESS || sweepStep == SweepStep::OBSERVE){
+                isCalibrated[range] = false;
+            }
+            sweepStep = SweepStep::IDLE;
+            reportCompleted(sweepSequence, status);
+            sweepSequence = NO_SEQUENCE;
+        }
+
+        void reportSweep(unsigned long elapsed_ms){
+            uint16_t reported_ms = elapsed_ms < 0xFFFF ? elapsed_ms : 0xFFFF;
+            if(sweepSequence != NO_SEQUENCE){
+                const uint8_t payload[] = { sweepOnMs, sweepOffMs, sweepPresses, (uint8_t)(reported_ms & 0xFF), (uint8_t)(reported_ms >> 8) };
+                sendFrame(FRAME_SWEEP_REPORT, sweepSequence, payload, sizeof(payload));
+            }
+
+            // "Sweep 40/40 ms: 10 presses in 801 ms"
+            char line[48];
+            uint8_t length = 0;
+            appendText(line, length, F("Sweep "));
+            appendNumber(line, length, sweepOnMs);
+            line[length++] = '/';
+            appendNumber(line, length, sweepOffMs);
+            appendText(line, length, F(" ms: "));
+            appendNumber(line, length, sweepPresses);
+            appendText(line, length, F(" presses in "));
+            appendNumber(line, length, reported_ms);
+            appendText(line, length, F(" ms\n"));
+            writeOutput((const uint8_t *)line, length);
+        }
+        static void appendText(char *line, uint8_t &length, const __FlashStringHelper *text){
+            const char *c = (const char *)text;
+            while(pgm_read_byte(c)){
+                line[length++] = pgm_read_byte(c++);
+            }
+        }
+        static void appendNumber(char *line, uint8_t &length, uint16_t value){
+            char digits[5];
+            uint8_t count = 0;
+            do {
+                digits[count++] = '0' + value % 10;
+                value /= 10;
+            } while(value != 0);
+            while(count > 0){
+                line[length++] = digits[--count];
+            }
+        }
+
+        // The next off time, then the next on time. False once every pair has been tried.
+        bool nextSweepTiming(){
+            if(sweepOffMs + sweepStepMs <= sweepLastMs){
+                sweepOffMs += sweepStepMs;
+                return true;
+            }
+            if(sweepOnMs + sweepStepMs <= sweepLastMs){
+                sweepOnMs += sweepStepMs;
+                sweepOffMs = sweepFirstMs;
+                return true;
+            }
+            return false;
+        }
+
+        // Advances the running sweep, must be called every loop
+        void sweepTick(){
+            if(sweepStep == SweepStep::IDLE || isActuatorBusy())
+                return;
+
+            switch(sweepStep){
+                case SweepStep::START:
+                    if(commandQueueCount > 0 || isPulsing)
+                        return;
+                    sweepStep = SweepStep::HOME;
+                    startPowerLevel(rangeBottom(range), Homing::VERIFY);
+                    break;
+
+                case SweepStep::HOME:
+                    sweepStep = SweepStep::PRESS;
+                    sweepStepAt = millis();
+                    startPowerLevel(rangeBottom(range) + sweepPresses, Homing::IF_NEEDED);
+                    break;
+
+                case SweepStep::PRESS:
+                    reportSweep(millis() - sweepStepAt);
+                    sweepStep = SweepStep::OBSERVE;
+                    sweepStepAt = millis();
+                    break;
+
+                case SweepStep::OBSERVE:
+                    if(millis() - sweepStepAt < SWEEP_OBSERVE_MS)
+                        return;
+                    sweepStep = nextSweepTiming() ? SweepStep::HOME : SweepStep::FINISH;
+                    startPowerLevel(rangeBottom(range), Homing::VERIFY);
+                    break;
+
+                case SweepStep::FINISH:
+                    endSweep(FRAME_STATUS_OK);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+    // Pressing the buttons
+        bool isActuatorBusy(){
+            return targetPowerLevel >= 0;
+        }
+        void setLed(uint8_t level){
+            if(pins().led != NO_PIN){
+                digitalWrite(pins().led, level);
+            }
+        }
+        void pressShockStart(){
+            Board::stopPulseTimer(channel);
+            setLed(HIGH);
+            digitalWrite(pins().shocker, HIGH);
+            reportStateShocking();
+            completePulse(FRAME_STATUS_SUPERSEDED);
+        }
+        void pressShockPulse(uint16_t length_ms, int16_t sequence){
+            Board::stopPulseTimer(channel);
+            completePulse(FRAME_STATUS_SUPERSEDED);
+
+            setLed(HIGH);
+            digitalWrite(pins().shocker, HIGH);
+            pulseEnded = false;
+            Board::startPulseTimer(channel, length_ms);
+            isPulsing = true;
+            pulseSequence = sequence;
+            reportStateShocking();
+        }
+        void pressShockStop(){
+            Board::stopPulseTimer(channel);
+            setLed(LOW);
+            digitalWrite(pins().shocker, LOW);
+
+            // A stop during a ramp only releases the shocker, the ramp itself carries on
+            if(isActuatorBusy()){
+                reportStateBusy();
+            } else {
+                reportStateIdle();
+            }
+            completePulse(FRAME_STATUS_CANCELLED);
+        }
+        void actuatorWait(ActuatorStep step, unsigned long length_ms){
+            actuatorStep = step;
+            actuatorStepStartUs = micros();
+            actuatorStepLengthUs = length_ms * 1000UL;
+        }
+        uint8_t powerPin(int direction){
+            return direction > 0 ? pins().increasePower : pins().decreasePower;
+        }
+
+    // Press train
+        // Starts pressing the power button presses times, the first press starts right away
+        void startPressTrain(int direction, int presses){
+            pressDirection = direction;
+            trainPressesWanted = presses < 0xFF ? presses : 0xFF;
+            trainPressesStarted = 1;
+            trainPressesDone = 0;
+            trainPressesCounted = 0;
+            trainEnded = false;
+            trainStartLevel = currentPowerLevel();
+            trainOnMs = isSweepPressing() ? sweepOnMs : pressOnMs;
+            trainOffMs = isSweepPressing() ? sweepOffMs : pressOffMs;
+
+            isTrainPressing = true;
+            digitalWrite(powerPin(direction), HIGH);
+            actuatorWait(ActuatorStep::PRESS_TRAIN, 0);
+            Board::startPressTimer(channel, trainOnMs);
+        }
+
+        // Called by the board's press timer, returns the ms until the next call or 0 once the train is done
+        uint8_t pressTimerEdge(){
+            if(isTrainPressing){
+                digitalWrite(powerPin(pressDirection), LOW);
+                isTrainPressing = false;
+                return trainOffMs;
+            }
+
+            trainPressesDone++;
+            if(trainPressesStarted >= trainPressesWanted){
+                trainEnded = true;
+                return 0;
+            }
+            trainPressesStarted++;
+            digitalWrite(powerPin(pressDirection), HIGH);
+            isTrainPressing = true;
+            return trainOnMs;
+        }
+
+        // Applies the presses the timer has finished since the last call
+        void countTrainPresses(){
+            uint8_t done = trainPressesDone;
+            if(done != trainPressesCounted){
+                powerLevels[range] += pressDirection * (done - trainPressesCounted);
+                trainPressesCounted = done;
+                reportPowerLevel();
+            }
+        }
+
+        // Lowers the wanted presses once the target has moved closer or out of the range, see Press train
+        void trimPressTrain(){
+            uint8_t started = trainPressesStarted; // The timer may start one more while this runs, the next train corrects it
+            int left = 0;
+            if(targetRange == range){
+                int goal = !isHoming ? targetPowerLevel : homingDirection < 0 ? rangeBottom(range) : rangeTop(range);
+                left = (goal - (trainStartLevel + pressDirection * started)) * pressDirection;
+            }
+            uint8_t wanted = started + (left > 0 ? left : 0);
+            if(wanted < trainPressesWanted){
+                trainPressesWanted = wanted;
+            }
+        }
+
+    // Range selection
+        void selectRange(uint8_t r){
+            if constexpr (Board::DUAL_RANGE){
+                digitalWrite(r == 1 ? Board::PIN_RANGE_LOW : Board::PIN_RANGE_HIGH, LOW);
+                digitalWrite(r == 1 ? Board::PIN_RANGE_HIGH : Board::PIN_RANGE_LOW, HIGH);
+            }
+        }
+        void startRangeSwitch(){
+            if constexpr (Board::DUAL_RANGE){
+                // A range left halfway through homing is as unknown as before
+                    if(isHoming){
+                        isHoming = false;
+                        isCalibrated[range] = false;
+                    }
+
+                switchingRange = targetRange;
+                digitalWrite(switchingRange == 1 ? Board::PIN_RANGE_LOW : Board::PIN_RANGE_HIGH, LOW);
+                actuatorWait(ActuatorStep::RANGE_RELEASE, Board::RANGE_RELEASE_TIME_MS);
+            }
+        }
+
+    // Homing
+    // WALK: the counter is set to the top and walked to the bottom, so the walk always gets there. Only the bottom is
+    // known to saturate, pressing increase at the top may wrap or stop on other units. Each range keeps its own counter
+    // on the device, so a range we switch back into is where we left it.
+    // HOLD: holding a power button runs the power into its end stop. A counter that is already trusted only needs
+    // to be held for its distance to the end stop, which makes a verify at a high level take a second instead of 18.
+        // HOLD: hold time that surely reaches the given end stop
+        unsigned long homingHoldTimeMs(int end, bool full){
+            if constexpr (HOLD_HOMING){
+                const unsigned long full_hold = Board::CALIBRATION_HOLD_TIME_S * 1000UL;
+                if(full)
+                    return full_hold;
+
+                unsigned long hold = (abs(end - currentPowerLevel()) + Board::CALIBRATION_MARGIN_STEPS) * full_hold / 99;
+                return hold < full_hold ? hold : full_hold;
+            } else {
+                return 0;
+            }
+        }
+
+        // HOLD: estimated time to home the target range toward the given end and reach set_to from there
+        unsigned long homingTimeMs(int set_to, int direction, bool full){
+            uint8_t r = rangeFor(set_to);
+            int end = direction < 0 ? rangeBottom(r) : rangeTop(r);
+            return homingHoldTimeMs(end, full) + abs(set_to - end) * (unsigned long)(pressOnMs + pressOffMs);
+        }
+
+        // HOLD heads for whichever end of the range leaves the shorter way to set_to, WALK always for the bottom
+        void startHoming(int set_to, bool full){
+            isHoming = true;
+            if constexpr (HOLD_HOMING){
+                homingDirection = homingTimeMs(set_to, 1, full) < homingTimeMs(set_to, -1, full) ? 1 : -1;
+                homingHoldMs = homingHoldTimeMs(homingDirection > 0 ? rangeTop(range) : rangeBottom(range), full);
+            } else {
+                homingDirection = -1;
+                powerLevels[range] = rangeTop(range);
+            }
+            isCalibrated[range] = true;
+        }
+
+    // Processing power adjustment
+        // Called once the ramp has reached its target
+        void finishPowerLevel(){
+            targetPowerLevel = -1;
+            calibrationChangedAt = millis();
+            #if SHOCKER_METRICS
+                metrics.rampMs.record(calibrationChangedAt - rampStartedAt);
+            #endif
+
+            // Report the new power level and reset state
+                reportPowerLevel();
+                reportStateIdle();
+                reportCompleted(targetSequence, FRAME_STATUS_OK);
+                targetSequence = NO_SEQUENCE;
+        }
+
+        // Decides the next button action of the running ramp
+        void actuatorPlanNext(){
+            // Select the target range first
+                if(range != targetRange){
+                    startRangeSwitch();
+                    return;
+                }
+
+            // A range with an unknown counter is homed first, HOLD boards also home when a calibration asked for it
+                if(!isCalibrated[range] || targetHoming != Homing::IF_NEEDED){
+                    startHoming(targetPowerLevel, targetHoming == Homing::FULL || !isCalibrated[range]);
+                    targetHoming = Homing::IF_NEEDED;
+                }
+
+            // Finish the way to the end of the range
+                if(isHoming){
+                    if constexpr (HOLD_HOMING){
+                        digitalWrite(powerPin(homingDirection), LOW);
+                        actuatorWait(ActuatorStep::CALIBRATION_RELEASE, Board::CALIBRATION_RELEASE_TIME_MS); // Small delay to ensure the pin state is settled
+                        return;
+                    } else {
+                        int end = homingDirection < 0 ? rangeBottom(range) : rangeTop(range);
+                        if(currentPowerLevel() != end){
+                            startPressTrain(homingDirection, abs(end - currentPowerLevel()));
+                            return;
+                        }
+                        isHoming = false;
+                    }
+                }
+
+            // Step untill the desired value is reached
+                if(currentPowerLevel() < targetPowerLevel){
+                    startPressTrain(1, targetPowerLevel - currentPowerLevel());
+                } else if(currentPowerLevel() > targetPowerLevel){
+                    startPressTrain(-1, currentPowerLevel() - targetPowerLevel);
+                } else {
+                    finishPowerLevel();
+                }
+        }
+
+        // Advances the running ramp, must be called every loop
+        void actuatorTick(){
+            if(actuatorStep == ActuatorStep::PRESS_TRAIN){
+                bool ended = trainEnded; // Read first, the timer counts the last press before it sets trainEnded
+                countTrainPresses();
+                if(!ended){
+                    trimPressTrain();
+                    return;
+                }
+                actuatorStep = ActuatorStep::IDLE;
+            }
+
+            if(actuatorStep != ActuatorStep::IDLE){
+                if(micros() - actuatorStepStartUs < actuatorStepLengthUs){
+                    return; // Current step is still running
+                }
+
+                switch(actuatorStep){
+                    case ActuatorStep::RANGE_RELEASE:
+                        if constexpr (Board::DUAL_RANGE){
+                            digitalWrite(switchingRange == 1 ? Board::PIN_RANGE_HIGH : Board::PIN_RANGE_LOW, HIGH);
+                            actuatorWait(ActuatorStep::RANGE_SETTLE, Board::RANGE_SETTLE_TIME_MS);
+                        }
+                        return;
+
+                    case ActuatorStep::RANGE_SETTLE:
+                        range = switchingRange; // actuatorPlanNext() switches back if the target moved meanwhile
+                        break;
+
+                    case ActuatorStep::CALIBRATION_RELEASE:
+                        // Hold down the button long enough to be sure we are at the end stop
+                        digitalWrite(powerPin(homingDirection), HIGH);
+                        actuatorWait(ActuatorStep::CALIBRATION_HOLD, homingHoldMs);
+                        return;
+
+                    case ActuatorStep::CALIBRATION_HOLD:
+                        digitalWrite(powerPin(homingDirection), LOW);
+                        powerLevels[range] = homingDirection > 0 ? rangeTop(range) : rangeBottom(range);
+                        isHoming = false;
+                        reportPowerLevel();
+                        break;
+
+                    default:
+                        break;
+                }
+                actuatorStep = ActuatorStep::IDLE;
+            }
+
+            if(isActuatorBusy()){
+                actuatorPlanNext();
+            }
+        }
+
+        // Starts a ramp to the requested power level, see Homing for when the range is homed first.
+        // Levels above 99 never get here, the parser and isPatternValid() turn them away.
+        void startPowerLevel(int set_to, Homing homing){
+            // Ensure the shocker is stopped before changing power level
+                pressShockStop();
+                reportStateBusy();
+                invalidateCalibration();
+                #if SHOCKER_METRICS
+                    rampStartedAt = millis();
+                #endif
+
+            // Kick off the first step right away
+                isHoming = false;
+                targetHoming = homing;
+                targetRange = rangeFor(set_to);
+                targetPowerLevel = set_to;
+                actuatorTick();
+        }
+
+        void setPowerLevel(int set_to){
+            startPowerLevel(set_to, Homing::IF_NEEDED);
+        }
+
+        // HOLD: re-homes the power and returns to the current level. The quick verify trusts the current level
+        // enough to only hold for its distance to the end stop, the full one crosses the whole range.
+        void calibratePowerLevel(bool quick){
+            startPowerLevel(currentPowerLevel(), quick ? Homing::VERIFY : Homing::FULL);
+        }
+
+        // Steers the running ramp to a new target without finishing the old one.
+        // A range switch that already started completes first and is switched back from if the target left that range,
+        // a homing walk completes only if the target stays in its range.
+        void retargetPowerLevel(int set_to, int16_t sequence){
+            reportCompleted(targetSequence, FRAME_STATUS_SUPERSEDED);
+            targetSequence = sequence;
+            targetPowerLevel = set_to;
+            targetRange = rangeFor(set_to);
+        }
+
+    // Command queue
+        Command &queuedCommand(uint8_t index){
+            return commandQueue[(commandQueueHead + index) % COMMAND_QUEUE_SIZE];
+        }
+        void queueCommand(CommandType type, int power_level, int16_t sequence, uint16_t pulse_time_ms = 0, uint32_t received_us = 0){
+            if(commandQueueCount == COMMAND_QUEUE_SIZE){
+                if(sequence == NO_SEQUENCE){
+                    reportError(ERROR_QUEUE_FULL);
+                }
+                reportRejected(sequence, FRAME_STATUS_QUEUE_FULL);
+                return;
+            }
+
+            Command &command = queuedCommand(commandQueueCount);
+            command.type = type;
+            command.powerLevel = power_level;
+            command.pulseTimeMs = pulse_time_ms;
+            command.sequence = sequence;
+            #if SHOCKER_METRICS
+                command.receivedUs = received_us;
+            #endif
+            commandQueueCount++;
+            reportAccepted(sequence);
+        }
+        void queuePowerLevel(int set_to, int16_t sequence){
+            // A ramp with nothing waiting behind it is steered to the new target directly
+                if(commandQueueCount == 0 && isActuatorBusy()){
+                    reportAccepted(sequence);
+                    retargetPowerLevel(set_to, sequence);
+                    return;
+                }
+
+            // Only the newest of back to back power commands is kept
+                if(commandQueueCount > 0){
+                    Command &newest = queuedCommand(commandQueueCount - 1);
+                    if(newest.type == CommandType::SET_POWER){
+                        reportAccepted(sequence);
+                        reportCompleted(newest.sequence, FRAME_STATUS_SUPERSEDED);
+                        newest.powerLevel = set_to;
+                        newest.sequence = sequence;
+                        return;
+                    }
+                }
+
+            queueCommand(CommandType::SET_POWER, set_to, sequence);
+        }
+        // A stop cancels every start and pulse that is still waiting, they were sent before it
+        void dropQueuedShockStarts(){
+            uint8_t kept = 0;
+            for(uint8_t i = 0; i < commandQueueCount; i++){
+                Command command = queuedCommand(i);
+                if(command.type != CommandType::SHOCK_START && command.type != CommandType::SHOCK_PULSE){
+                    queuedCommand(kept++) = command;
+                } else {
+                    reportCompleted(command.sequence, FRAME_STATUS_CANCELLED);
+                }
+            }
+            commandQueueCount = kept;
+        }
+        // Runs queued commands until one of them starts a ramp
+        void processCommandQueue(){
+            while(commandQueueCount > 0 && !isActuatorBusy()){
+                Command command = queuedCommand(0);
+                commandQueueHead = (commandQueueHead + 1) % COMMAND_QUEUE_SIZE;
+                commandQueueCount--;
+
+                switch(command.type){
+                    case CommandType::SHOCK_START:
+                        pressShockStart();
+                        recordEdgeLatency(receivedAt(command));
+                        pressShockStart();
+                        reportCompleted(command.sequence, FRAME_STATUS_OK);
+                        break;
+
+                    case CommandType::SHOCK_PULSE:
+                        pressShockPulse(command.pulseTimeMs, command.sequence);
+                        recordEdgeLatency(receivedAt(command));
+                        break;
+
+                    case CommandType::SET_POWER:
+                        targetSequence = command.sequence;
+                        setPowerLevel(command.powerLevel);
+                        break;
+
+                    case CommandType::CALIBRATE:
+                        targetSequence = command.sequence;
+                        calibratePowerLevel(false);
+                        break;
+
+                    case CommandType::VERIFY_CALIBRATION:
+                        targetSequence = command.sequence;
+                        calibratePowerLevel(true);
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+        }
+
+        // A stop cancels the waiting starts and releases the shocker right away
+        void stopShock(uint32_t received_us = 0){
+            ShockerState before = currentState;
+            dropQueuedShockStarts();
+            pressShockStop();
+            recordEdgeLatency(received_us);
+            pressShockStop();
+            if(currentState == before){
+                sendStatus(); // Nothing was shocking, the host still gets an answer
+            }
+        }
+
+    // Patterns
+        static uint16_t readWord(const uint8_t *data){
+            return data[0] | (uint16_t)data[1] << 8;
+        }
+        // Operand bytes of an instruction, 0xFF for an unknown opcode
+        static uint8_t patternOperandSize(uint8_t opcode){
+            switch(opcode){
+                case PATTERN_END:          return 0;
+                case PATTERN_POWER:        return 1;
+                case PATTERN_POWER_RANDOM: return 2;
+                case PATTERN_PULSE:        return 2;
+                case PATTERN_PULSE_RANDOM: return 4;
+                case PATTERN_WAIT:         return 2;
+                case PATTERN_WAIT_RANDOM:  return 4;
+                case PATTERN_LOOP:         return 2;
+                default:                   return 0xFF;
+            }
+        }
+        static bool isPatternBoundary(const uint8_t *program, uint8_t offset){
+            uint8_t pc = 0;
+            while(pc < offset){
+                pc += 1 + patternOperandSize(program[pc]);
+            }
+            return pc == offset;
+        }
+        // Checks a program before it is stored, so running it never has to
+        static bool isPatternValid(const uint8_t *program, uint8_t length){
+            uint8_t pc = 0;
+            for(;;){
+                if(pc >= length)
+                    return false; // No END
+                uint8_t opcode = program[pc];
+                uint8_t size = patternOperandSize(opcode);
+                if(size == 0xFF || pc + 1 + size > length)
+                    return false;
+
+                const uint8_t *operands = &program[pc + 1];
+                bool valid = true;
+                switch(opcode){
+                    case PATTERN_POWER:
+                        valid = operands[0] <= 99;
+                        break;
+                    case PATTERN_POWER_RANDOM:
+                        valid = operands[0] <= operands[1] && operands[1] <= 99;
+                        break;
+                    case PATTERN_PULSE:
+                        valid = readWord(operands) >= 1 && readWord(operands) <= PULSE_MAX_TIME_MS;
+                        break;
+                    case PATTERN_PULSE_RANDOM:
+                        valid = readWord(operands) >= 1 && readWord(operands) <= readWord(operands + 2) && readWord(operands + 2) <= PULSE_MAX_TIME_MS;
+                        break;
+                    case PATTERN_WAIT_RANDOM:
+                        valid = readWord(operands) <= readWord(operands + 2);
+                        break;
+                    case PATTERN_LOOP:
+                        valid = operands[0] < pc && isPatternBoundary(program, operands[0]);
+                        break;
+                }
+                if(!valid)
+                    return false;
+                if(opcode == PATTERN_END)
+                    break;
+                pc += 1 + size;
+            }
+            if(pc + 1 != length)
+                return false; // Bytes after the END
+
+            // Loops have to nest, and not deeper than PATTERN_LOOP_DEPTH
+            for(uint8_t a = 0; a < length; a += 1 + patternOperandSize(program[a])){
+                if(program[a] != PATTERN_LOOP)
+                    continue;
+                uint8_t depth = 1;
+                for(uint8_t b = 0; b < length; b += 1 + patternOperandSize(program[b])){
+                    if(program[b] != PATTERN_LOOP || b == a)
+                        continue;
+                    uint8_t a_start = program[a + 1];
+                    uint8_t b_start = program[b + 1];
+                    if(b < a_start || a < b_start)
+                        continue; // Apart
+                    if(b_start <= a_start && a < b){
+                        depth++; // b runs around a
+                    } else if(!(a_start <= b_start && b < a)){
+                        return false; // Overlapping
+                    }
+                }
+                if(depth > PATTERN_LOOP_DEPTH)
+                    return false;
+            }
+            return true;
+        }
+
+        bool isPatternRunning(){
+            return patternStep != PatternStep::IDLE;
+        }
+        uint16_t patternRandomIn(uint16_t min, uint16_t max){
+            // xorshift32
+            patternRandom ^= patternRandom << 13;
+            patternRandom ^= patternRandom >> 17;
+            patternRandom ^= patternRandom << 5;
+            return min + patternRandom % (max - min + 1UL);
+        }
+
+        void startPattern(uint8_t slot, uint16_t seed, uint8_t flags, int16_t sequence){
+            patternSlot = slot;
+            patternPc = 0;
+            patternFlags = flags;
+            patternRandom = ((uint32_t)seed << 16 | seed) ^ 0x2545F491; // Never 0, which xorshift can't leave
+            patternLoopDepth = 0;
+            patternSequence = sequence;
+            patternStep = PatternStep::RUN;
+            patternTick();
+        }
+        // A pattern that doesn't end on its own releases the shocker and drops the shocks it queued
+        void endPattern(uint8_t status){
+            if(!isPatternRunning())
+                return;
+
+            patternStep = PatternStep::IDLE;
+            if(status != FRAME_STATUS_OK){
+                dropQueuedShockStarts();
+                if(isPulsing){
+                    pressShockStop();
+                }
+            }
+            reportCompleted(patternSequence, status);
+            patternSequence = NO_SEQUENCE;
+        }
+
+        void patternWait(uint16_t units){
+            // Start the ramp of the next power change during the wait
+                if(patternFlags & PATTERN_FLAG_PREPOSITION){
+                    uint8_t next = patterns[patternSlot][patternPc];
+                    if(next == PATTERN_POWER || next == PATTERN_POWER_RANDOM){
+                        runPatternInstruction();
+                    }
+                }
+
+            patternWaitStartUs = micros();
+            patternWaitUs = units * (PATTERN_WAIT_UNIT_MS * 1000UL);
+            patternStep = PatternStep::WAIT;
+        }
+        void patternPulse(uint16_t length_ms){
+            queueCommand(CommandType::SHOCK_PULSE, 0, NO_SEQUENCE, length_ms);
+            patternStep = PatternStep::SETTLE;
+        }
+        void patternLoop(uint8_t loop_pc, uint8_t start, uint8_t count){
+            // Entering the loop
+                if(patternLoopDepth == 0 || patternLoopPcs[patternLoopDepth - 1] != loop_pc){
+                    patternLoopPcs[patternLoopDepth] = loop_pc;
+                    patternLoopRemaining[patternLoopDepth] = count;
+                    patternLoopDepth++;
+                }
+
+            uint8_t &remaining = patternLoopRemaining[patternLoopDepth - 1];
+            if(remaining != 0 && --remaining == 0){
+                patternLoopDepth--; // Done, carry on after it
+                return;
+            }
+            patternPc = start;
+        }
+
+        void runPatternInstruction(){
+            uint8_t pc = patternPc;
+            const uint8_t *program = patterns[patternSlot];
+            const uint8_t *operands = &program[pc + 1];
+            patternPc += 1 + patternOperandSize(program[pc]);
+
+            switch(program[pc]){
+                case PATTERN_END:
+                    patternStep = PatternStep::FINISH;
+                    break;
+
+                case PATTERN_POWER:
+                    queuePowerLevel(operands[0], NO_SEQUENCE);
+                    break;
+
+                case PATTERN_POWER_RANDOM:
+                    queuePowerLevel(patternRandomIn(operands[0], operands[1]), NO_SEQUENCE);
+                    break;
+
+                case PATTERN_PULSE:
+                    patternPulse(readWord(operands));
+                    break;
+
+                case PATTERN_PULSE_RANDOM:
+                    patternPulse(patternRandomIn(readWord(operands), readWord(operands + 2)));
+                    break;
+
+                case PATTERN_WAIT:
+                    patternWait(readWord(operands));
+                    break;
+
+                case PATTERN_WAIT_RANDOM:
+                    patternWait(patternRandomIn(readWord(operands), readWord(operands + 2)));
+                    break;
+
+                case PATTERN_LOOP:
+                    patternLoop(pc, operands[0], operands[1]);
+                    break;
+            }
+        }
+
+        // Advances the running pattern, must be called every loop
+        void patternTick(){
+            switch(patternStep){
+                case PatternStep::IDLE:
+                    return;
+
+                case PatternStep::WAIT:
+                    if(micros() - patternWaitStartUs < patternWaitUs)
+                        return;
+                    break;
+
+                case PatternStep::SETTLE:
+                    if(commandQueueCount > 0 || isPulsing)
+                        return;
+                    break;
+
+                case PatternStep::FINISH:
+                    if(commandQueueCount > 0 || isPulsing || isActuatorBusy())
+                        return;
+                    endPattern(FRAME_STATUS_OK);
+                    return;
+
+                default:
+                    break;
+            }
+
+            // A LOOP without a WAIT or PULSE in it gets a fresh batch of steps every loop
+            patternStep = PatternStep::RUN;
+            for(uint8_t steps = 0; steps < PATTERN_STEPS_PER_TICK && patternStep == PatternStep::RUN; steps++){
+                runPatternInstruction();
+            }
+            processCommandQueue();
+        }
+
+        // Milliseconds until the channel has something to do, idle_ms if it is only waiting for commands
+        unsigned long msUntilDue(unsigned long idle_ms){
+            unsigned long due_ms = idle_ms;
+            if(actuatorStep != ActuatorStep::IDLE && actuatorStep != ActuatorStep::PRESS_TRAIN){ // A train wakes the loop from its timer
+                unsigned long elapsed_us = micros() - actuatorStepStartUs;
+                due_ms = elapsed_us >= actuatorStepLengthUs ? 0 : (actuatorStepLengthUs - elapsed_us) / 1000;
+            }
+            if(patternStep == PatternStep::WAIT){
+                unsigned long elapsed_us = micros() - patternWaitStartUs;
+                unsigned long wait_ms = elapsed_us >= patternWaitUs ? 0 : (patternWaitUs - elapsed_us) / 1000;
+                due_ms = wait_ms < due_ms ? wait_ms : due_ms;
+            }
+            if(!isCalibrationStored && currentState == ShockerState::IDLE){
+                unsigned long elapsed_ms = millis() - calibrationChangedAt;
+                unsigned long save_ms = elapsed_ms >= CALIBRATION_SAVE_DELAY_MS ? 0 : CALIBRATION_SAVE_DELAY_MS - elapsed_ms;
+                due_ms = save_ms < due_ms ? save_ms : due_ms;
+            }
+            if(sweepStep == SweepStep::OBSERVE){
+                unsigned long elapsed_ms = millis() - sweepStepAt;
+                unsigned long observe_ms = elapsed_ms >= SWEEP_OBSERVE_MS ? 0 : SWEEP_OBSERVE_MS - elapsed_ms;
+                due_ms = observe_ms < due_ms ? observe_ms : due_ms;
+            }
+            if(isPowerDirty){
+                unsigned long elapsed_ms = millis() - statusSentAt;
+                unsigned long status_ms = elapsed_ms >= STATUS_INTERVAL_MS ? 0 : STATUS_INTERVAL_MS - elapsed_ms;
+                due_ms = status_ms < due_ms ? status_ms : due_ms;
+            }
+            return due_ms;
+        }
+
+        // Nothing running or queued, a calibration save may still be due (see msUntilDue())
+        bool isIdle(){
+            return currentState == ShockerState::IDLE && !isActuatorBusy() && !isPatternRunning() && !isSweepRunning() && !isPulsing
+                && commandQueueCount == 0;
+        }
+
+    // Requests
+        // Runs a request from the parser on this channel, ShockerCore::handleRequest() takes the pattern uploads
+        void handleRequest(const Command &request){
+            // The host taking over ends the running pattern
+                bool is_takeover = request.type != CommandType::REJECT && request.type != CommandType::SHOCK_STOP;
+                if(is_takeover){
+                    endPattern(FRAME_STATUS_SUPERSEDED);
+                    endSweep(FRAME_STATUS_SUPERSEDED);
+                }
+
+            switch(request.type){
+                case CommandType::SHOCK_STOP:
+                    reportAccepted(request.sequence);
+                    stopShock(receivedAt(request));
+                    endPattern(FRAME_STATUS_CANCELLED);
+                    endSweep(FRAME_STATUS_CANCELLED);
+                    reportCompleted(request.sequence, FRAME_STATUS_OK);
+                    break;
+
+                case CommandType::PATTERN_START:
+                    if(patternLengths[request.powerLevel] == 0){
+                        if(request.sequence == NO_SEQUENCE){
+                            reportError(ERROR_PATTERN_EMPTY);
+                        }
+                        reportRejected(request.sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    reportAccepted(request.sequence);
+                    startPattern(request.powerLevel, request.pulseTimeMs, request.status, request.sequence);
+                    break;
+
+                case CommandType::SET_TIMING:
+                    reportAccepted(request.sequence);
+                    setPressTiming(request.pulseTimeMs & 0xFF, request.pulseTimeMs >> 8);
+                    reportCompleted(request.sequence, FRAME_STATUS_OK);
+                    break;
+
+                case CommandType::TIMING_SWEEP:
+                    if(request.powerLevel > rangeTop(range) - rangeBottom(range)){
+                        reportRejected(request.sequence, FRAME_STATUS_INVALID); // Has to fit in the selected range
+                        break;
+                    }
+                    reportAccepted(request.sequence);
+                    startSweep(request.pulseTimeMs & 0xFF, request.pulseTimeMs >> 8, request.status, request.powerLevel, request.sequence);
+                    break;
+
+                case CommandType::REJECT:
+                    reportRejected(request.sequence, request.status);
+                    break;
+
+                case CommandType::SET_POWER:
+                    queuePowerLevel(request.powerLevel, request.sequence);
+                    break;
+
+                default:
+                    queueCommand(request.type, request.powerLevel, request.sequence, request.pulseTimeMs, receivedAt(request));
+                    break;
+            }
+        }
+
+    // Running
+        // Sets up the pins and restores the calibration of the channel
+        void begin(uint8_t index, const uint8_t (*slots)[Board::PATTERN_MAX_SIZE], const uint8_t *slot_lengths){
+            channel = index;
+            patterns = slots;
+            patternLengths = slot_lengths;
+
+            // Set pin modes
+                if(pins().led != NO_PIN){
+                    pinMode(pins().led, OUTPUT);
+                }
+                pinMode(pins().shocker, OUTPUT);
+                pinMode(pins().increasePower, OUTPUT);
+                pinMode(pins().decreasePower, OUTPUT);
+                if constexpr (Board::DUAL_RANGE){
+                    pinMode(Board::PIN_RANGE_LOW, OUTPUT);
+                    pinMode(Board::PIN_RANGE_HIGH, OUTPUT);
+                }
+                pressShockStop();
+
+            // Restore the power levels from before the reboot and select their range, the low range if nothing was stored
+                loadCalibration();
+                loadPressTiming();
+                if constexpr (Board::DUAL_RANGE){
+                    selectRange(range);
+                    delay(Board::RANGE_SETTLE_TIME_MS);
+                }
+                sendStatus(); // Lets the host show the state and the restored level
+        }
+
+        // Pulse end, ramp, queued commands, storage and status of the channel
+        void update(){
+            if(pulseEnded){
+                pressShockStop(); // The timer already released the shocker, this reports it
+            }
+            actuatorTick();
+            patternTick();
+            sweepTick();
+            processCommandQueue();
+            calibrationTick();
+            statusTick();
+        }
+};
+
+
+template <typename Board> class ShockerCore {
+public:
+    typedef ShockerChannel<Board> Channel;
+    static constexpr uint8_t CHANNEL_COUNT = sizeof(Board::CHANNELS) / sizeof(Board::CHANNELS[0]);
+    static constexpr bool HOLD_HOMING = Channel::HOLD_HOMING;
+    static constexpr uint8_t FRAME_MAX_PAYLOAD = 1 + Board::PATTERN_MAX_SIZE; // A pattern upload is the longest command
+    static constexpr uint16_t RX_CREDIT = Board::SERIAL_RX_CAPACITY - CREDIT_SLACK;
+
+    static_assert(CHANNEL_COUNT <= FRAME_MAX_CHANNELS, "A frame opcode has room for FRAME_MAX_CHANNELS channels");
+    static_assert(!Board::DUAL_RANGE || CHANNEL_COUNT == 1, "The range selectors are wired to a single unit");
+
+    // State
+        Channel channels[CHANNEL_COUNT];
+        uint8_t asciiChannel = 0; // Channel the ASCII commands go to, see Channels above
+
+        // Pattern slots
+        // Shared by the channels, only the actuator side writes them.
+            uint8_t patterns[Board::PATTERN_SLOTS][Board::PATTERN_MAX_SIZE];
+            uint8_t patternLengths[Board::PATTERN_SLOTS] = {}; // 0 for an empty slot
+
+            // With SPLIT_TASKS an upload is copied here by the parser side and into its slot by the actuator side.
+            // Only the parser side sets patternUploadPending and only the actuator side clears it.
+            uint8_t patternUpload[Board::SPLIT_TASKS ? Board::PATTERN_MAX_SIZE : 1];
+            uint8_t patternUploadPending = 0;
+
+        // Command parser
+        // Fed one byte at a time, a half received command never holds up the others.
+            CommandParser<FRAME_MAX_PAYLOAD> commandParser{"PDRU", Board::POWER_COMMAND_TIMEOUT_MS, FRAME_TIMEOUT_MS};
+
+        // Flow control
+        // Parser side only, see Flow control above.
+            uint16_t rxRead = 0;     // Bytes read since boot, line endings between commands left out
+            uint16_t rxReported = 0; // rxRead in the last FRAME_CREDIT
+            bool isFramedHost = false; // A frame came in since boot, credit reports only go to a host that reads frames
+
+        // Metrics
+        // The parser side counts the RX overflows, the histograms are in ShockerChannel::metrics.
+            #if SHOCKER_METRICS
+                uint32_t commandReceivedUs = 0; // micros() when the parser finished the command being handled
+                uint16_t rxOverflows = 0;
+            #endif
+
+        // Recorder
+        // Parser side only, see Recorder above.
+            #if SHOCKER_RECORDER
+                SerialRecorder<SHOCKER_RECORDER> recorder;
+            #endif
+
+
+    // Pattern slots
+        // Every channel running the old program in the slot is stopped first
+        void storePattern(uint8_t slot, const uint8_t *program, uint8_t length){
+            for(Channel &channel : channels){
+                if(channel.isPatternRunning() && channel.patternSlot == slot){
+                    channel.endPattern(FRAME_STATUS_SUPERSEDED);
+                }
+            }
+            memcpy(patterns[slot], program, length);
+            patternLengths[slot] = length;
+            if constexpr (Board::PATTERN_STORAGE){
+                Board::writePattern(slot, program, length);
+            }
+        }
+        void loadPatterns(){
+            if constexpr (Board::PATTERN_STORAGE){
+                for(uint8_t slot = 0; slot < Board::PATTERN_SLOTS; slot++){
+                    uint8_t length = Board::readPattern(slot, patterns[slot], Board::PATTERN_MAX_SIZE);
+                    patternLengths[slot] = Channel::isPatternValid(patterns[slot], length) ? length : 0;
+                }
+            }
+        }
+
+    // Handshake
+        void sendBanner(){
+            Serial.print(F("Ready ciab-shocker "));
+            Serial.print(FIRMWARE_VERSION_MAJOR);
+            Serial.print('.');
+            Serial.print(FIRMWARE_VERSION_MINOR);
+            Serial.print(F(" board="));
+            Serial.print(Board::NAME);
+            Serial.print(F(" channels="));
+            Serial.print(CHANNEL_COUNT);
+            Serial.print(F(" ranges="));
+            Serial.print(Channel::RANGE_COUNT);
+            Serial.print(F(" patterns="));
+            Serial.print(Board::PATTERN_SLOTS);
+            Serial.print(F(" caps=frames,snapshot,timing"));
+            if constexpr (HOLD_HOMING){
+                Serial.print(F(",calibrate"));
+            }
+            #if SHOCKER_METRICS
+                Serial.print(F(",metrics"));
+            #endif
+            if constexpr (Board::PATTERN_STORAGE){
+                Serial.print(F(",pattern-storage"));
+            }
+            if constexpr (Board::UART_WAKE){
+                Serial.print(F(",uart-wake"));
+            }
+            #if SHOCKER_RECORDER
+                Serial.print(F(",recorder"));
+            #endif
+            Serial.print(F(",credit\n"));
+        }
+
+        #if SHOCKER_RECORDER
+            // See Recorder above
+            void printRecording(){
+                static const char HEX_DIGITS[] PROGMEM = "0123456789abcdef";
+                recorder.forEachBurst([](unsigned long ms, const uint8_t *bytes, uint8_t length){
+                    char line[2 * SerialRecorder<SHOCKER_RECORDER>::MAX_BURST + 1];
+                    for(uint8_t i = 0; i < length; i++){
+                        line[2 * i] = pgm_read_byte(&HEX_DIGITS[bytes[i] >> 4]);
+                        line[2 * i + 1] = pgm_read_byte(&HEX_DIGITS[bytes[i] & 0x0F]);
+                    }
+                    line[2 * length] = '\n';
+                    Serial.print('@');
+                    Serial.print(ms);
+                    Serial.print(' ');
+                    Serial.write((const uint8_t *)line, 2 * length + 1);
+                });
+                Serial.print(F("@end\n"));
+            }
+        #endif
+
+        // Actuator side, so the state can't change halfway through
+        void sendSnapshot(Channel &channel, int16_t sequence, uint16_t rx_read){
+            uint8_t payload[SNAPSHOT_MAX_SIZE];
+            uint8_t length = 0;
+            unsigned long uptime_ms = millis();
+
+            payload[length++] = FIRMWARE_VERSION_MAJOR;
+            payload[length++] = FIRMWARE_VERSION_MINOR;
+            payload[length++] = CHANNEL_COUNT;
+            payload[length++] = (uint8_t)channel.currentState;
+            payload[length++] = (channel.isCalibrationStored ? SNAPSHOT_FLAG_STORED : 0)
+                | (channel.isActuatorBusy() ? SNAPSHOT_FLAG_RAMP : 0)
+                | (channel.isPatternRunning() ? SNAPSHOT_FLAG_PATTERN : 0);
+            for(uint8_t i = 0; i < 4; i++){
+                payload[length++] = uptime_ms >> (8 * i);
+            }
+            payload[length++] = channel.range;
+            payload[length++] = Channel::RANGE_COUNT;
+            for(uint8_t r = 0; r < Channel::RANGE_COUNT; r++){
+                payload[length++] = channel.powerLevels[r];
+                payload[length++] = channel.isCalibrated[r];
+            }
+            payload[length++] = channel.pressOnMs;
+            payload[length++] = channel.pressOffMs;
+            payload[length++] = RX_CREDIT & 0xFF;
+            payload[length++] = RX_CREDIT >> 8;
+            payload[length++] = rx_read & 0xFF;
+            payload[length++] = rx_read >> 8;
+            channel.sendFrame(FRAME_SNAPSHOT_REPORT, sequence, payload, length);
+        }
+
+    // Requests
+    // Everything the parser asks for goes through handleRequest(), directly or, with SPLIT_TASKS, through the
+    // board's queue to the actuator task.
+        void handleRequest(const Command &request){
+            Channel &channel = channels[request.channel];
+            switch(request.type){
+                case CommandType::PATTERN_UPLOAD:
+                    channel.reportAccepted(request.sequence);
+                    if constexpr (Board::SPLIT_TASKS){
+                        storePattern(request.powerLevel, patternUpload, request.pulseTimeMs);
+                        __atomic_store_n(&patternUploadPending, 0, __ATOMIC_RELEASE);
+                    } else {
+                        storePattern(request.powerLevel, commandParser.framePayload() + 1, request.pulseTimeMs); // Still the frame being handled
+                    }
+                    channel.reportCompleted(request.sequence, FRAME_STATUS_OK);
+                    break;
+
+                #if SHOCKER_METRICS
+                    case CommandType::METRICS:
+                        {
+                            uint8_t payload[METRICS_REPORT_SIZE];
+                            uint8_t *end = Channel::metrics.edgeLatencyUs.serialize(payload);
+                            end = Channel::metrics.rampMs.serialize(end);
+                            end = Channel::metrics.loopUs.serialize(end);
+                            end[0] = request.pulseTimeMs & 0xFF;
+                            end[1] = request.pulseTimeMs >> 8;
+                            channel.sendFrame(FRAME_METRICS_REPORT, request.sequence, payload, METRICS_REPORT_SIZE);
+                        }
+                        break;
+
+                    case CommandType::METRICS_RESET:
+                        channel.reportAccepted(request.sequence);
+                        Channel::metrics.clear();
+                        channel.reportCompleted(request.sequence, FRAME_STATUS_OK);
+                        break;
+                #endif
+
+                case CommandType::SNAPSHOT:
+                    sendSnapshot(channel, request.sequence, request.pulseTimeMs);
+                    break;
+
+                default:
+                    channel.handleRequest(request);
+                    break;
+            }
+        }
+        void sendRequest(uint8_t channel, CommandType type, int16_t sequence, int power_level = 0, uint16_t pulse_time_ms = 0, uint8_t status = FRAME_STATUS_OK){
+            Command request;
+            request.type = type;
+            request.powerLevel = power_level;
+            request.pulseTimeMs = pulse_time_ms;
+            request.sequence = sequence;
+            request.status = status;
+            request.channel = channel;
+            #if SHOCKER_METRICS
+                request.receivedUs = commandReceivedUs;
+            #endif
+
+            if constexpr (Board::SPLIT_TASKS){
+                Board::submit(request);
+            } else {
+                handleRequest(request);
+                channels[channel].processCommandQueue();
+            }
+        }
+        void rejectRequest(uint8_t channel, int16_t sequence, uint8_t status){
+            sendRequest(channel, CommandType::REJECT, sequence, 0, 0, status);
+        }
+
+    // ASCII commands
+        void handleCommand(char command){
+            switch(command){
+                case '1':
+                    sendRequest(asciiChannel, CommandType::SHOCK_START, NO_SEQUENCE);
+                    break;
+
+                case '0':
+                    sendRequest(asciiChannel, CommandType::SHOCK_STOP, NO_SEQUENCE);
+                    break;
+
+                case '\r':
+                case '\n': // Line endings of a serial monitor and the wake bytes of a host, see Handshake
+                    break;
+
+                #if SHOCKER_RECORDER
+                    case 'L':
+                        printRecording();
+                        break;
+                #endif
+
+                case 'C': // Re-home the power level from scratch
+                case 'V': // Quick re-home from the current power level
+                    if constexpr (HOLD_HOMING){
+                        sendRequest(asciiChannel, command == 'C' ? CommandType::CALIBRATE : CommandType::VERIFY_CALIBRATION, NO_SEQUENCE);
+                        break;
+                    }
+                    [[fallthrough]];
+
+                default:
+                    if(!Board::handleCommand(command)){
+                        sendError(ERROR_UNKNOWN_COMMAND);
+                    }
+                    break;
+            }
+        }
+
+        void handleNumberCommand(char command, uint32_t number){
+            switch(command){
+                case 'P':
+                    if (number <= 99) {
+                        sendRequest(asciiChannel, CommandType::SET_POWER, NO_SEQUENCE, number);
+                    } else {
+                        sendError(ERROR_POWER_RANGE);
+                    }
+                    break;
+
+                case 'D':
+                    // Shock for the given number of milliseconds, e.g. D1500!
+                    if (number >= 1 && number <= PULSE_MAX_TIME_MS) {
+                        sendRequest(asciiChannel, CommandType::SHOCK_PULSE, NO_SEQUENCE, 0, number);
+                    } else {
+                        sendError(ERROR_PULSE_RANGE);
+                    }
+                    break;
+
+                case 'R':
+                    // Run the pattern in the given slot with a seed from the clock, e.g. R0!
+                    if (number < Board::PATTERN_SLOTS) {
+                        sendRequest(asciiChannel, CommandType::PATTERN_START, NO_SEQUENCE, number, (uint16_t)micros(), PATTERN_FLAG_PREPOSITION);
+                    } else {
+                        sendError(ERROR_PATTERN_SLOT);
+                    }
+                    break;
+
+                case 'U':
+                    // Send the following ASCII commands to the given channel, e.g. U1!P20!
+                    if (number < CHANNEL_COUNT) {
+                        asciiChannel = number;
+                    } else {
+                        sendError(ERROR_CHANNEL);
+                    }
+                    break;
+            }
+        }
+
+        // See Errors above
+        void sendError(uint8_t code, char command = 0){
+            Serial.print('E');
+            Serial.print(code);
+            if(command != 0){
+                Serial.print(command);
+            }
+            Serial.print('\n');
+        }
+
+    // Framed commands
+        void handleFrame(uint8_t opcode, uint8_t sequence, const uint8_t *payload, uint8_t length){
+            uint8_t channel = (opcode >> FRAME_CHANNEL_SHIFT) & (FRAME_MAX_CHANNELS - 1);
+            if(channel >= CHANNEL_COUNT){
+                rejectRequest(0, sequence, FRAME_STATUS_UNKNOWN_CHANNEL);
+                return;
+            }
+
+            switch(opcode & FRAME_OPCODE_MASK){
+                case FRAME_SHOCK_START:
+                    if(length != 0){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::SHOCK_START, sequence);
+                    break;
+
+                case FRAME_SHOCK_STOP:
+                    if(length != 0){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::SHOCK_STOP, sequence);
+                    break;
+
+                case FRAME_SET_POWER:
+                    if(length != 1 || payload[0] > 99){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::SET_POWER, sequence, payload[0]);
+                    break;
+
+                case FRAME_CALIBRATE:
+                    if(!HOLD_HOMING){
+                        rejectRequest(channel, sequence, FRAME_STATUS_UNKNOWN_OPCODE);
+                        break;
+                    }
+                    if(length > 1 || (length == 1 && payload[0] > 1)){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, length == 1 && payload[0] == 1 ? CommandType::VERIFY_CALIBRATION : CommandType::CALIBRATE, sequence);
+                    break;
+
+                case FRAME_SHOCK_PULSE:
+                    {
+                        uint16_t length_ms = length == 2 ? payload[0] | (uint16_t)payload[1] << 8 : 0;
+                        if(length_ms == 0 || length_ms > PULSE_MAX_TIME_MS){
+                            rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                            break;
+                        }
+                        sendRequest(channel, CommandType::SHOCK_PULSE, sequence, 0, length_ms);
+                    }
+                    break;
+
+                case FRAME_PATTERN_UPLOAD:
+                    if(length < 2 || payload[0] >= Board::PATTERN_SLOTS || !Channel::isPatternValid(payload + 1, length - 1)){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    if constexpr (Board::SPLIT_TASKS){
+                        if(__atomic_load_n(&patternUploadPending, __ATOMIC_ACQUIRE)){
+                            rejectRequest(channel, sequence, FRAME_STATUS_QUEUE_FULL); // The last upload isn't stored yet
+                            break;
+                        }
+                        patternUploadPending = 1;
+                        memcpy(patternUpload, payload + 1, length - 1);
+                    }
+                    sendRequest(channel, CommandType::PATTERN_UPLOAD, sequence, payload[0], length - 1);
+                    break;
+
+                case FRAME_PATTERN_START:
+                    if(length < 1 || length == 2 || length > 4 || payload[0] >= Board::PATTERN_SLOTS){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::PATTERN_START, sequence, payload[0],
+                        length >= 3 ? Channel::readWord(payload + 1) : (uint16_t)micros(),
+                        length == 4 ? payload[3] : 0);
+                    break;
+
+                case FRAME_SNAPSHOT:
+                    if(length != 0){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::SNAPSHOT, sequence, 0, rxRead);
+                    break;
+
+                case FRAME_SET_TIMING:
+                    if(length != 2 || payload[0] == 0 || payload[1] == 0 || payload[0] > PRESS_TIME_MAX_MS || payload[1] > PRESS_TIME_MAX_MS){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::SET_TIMING, sequence, 0, payload[0] | (uint16_t)payload[1] << 8);
+                    break;
+
+                case FRAME_TIMING_SWEEP:
+                    if(length != 4 || payload[0] == 0 || payload[0] > payload[1] || payload[1] > PRESS_TIME_MAX_MS || payload[2] == 0
+                        || payload[3] == 0 || payload[3] > 99){
+                        rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                        break;
+                    }
+                    sendRequest(channel, CommandType::TIMING_SWEEP, sequence, payload[3], payload[0] | (uint16_t)payload[1] << 8, payload[2]);
+                    break;
+
+                #if SHOCKER_METRICS
+                    case FRAME_METRICS:
+                    case FRAME_METRICS_RESET:
+                        if(length != 0){
+                            rejectRequest(channel, sequence, FRAME_STATUS_INVALID);
+                            break;
+                        }
+                        if((opcode & FRAME_OPCODE_MASK) == FRAME_METRICS){
+                            sendRequest(channel, CommandType::METRICS, sequence, 0, rxOverflows);
+                        } else {
+                            rxOverflows = 0;
+                            sendRequest(channel, CommandType::METRICS_RESET, sequence);
+                        }
+                        break;
+                #endif
+
+                default:
+                    rejectRequest(channel, sequence, FRAME_STATUS_UNKNOWN_OPCODE);
+                    break;
+            }
+        }
+
+    // Command parser
+        void handleParseResult(ParseResult result){
+            switch(result){
+                case ParseResult::NONE:
+                    break;
+
+                case ParseResult::COMMAND:
+                    handleCommand(commandParser.command);
+                    break;
+
+                case ParseResult::NUMBER:
+                    handleNumberCommand(commandParser.command, commandParser.number);
+                    break;
+
+                case ParseResult::BAD_NUMBER:
+                    // Invalid character, or more digits than any command takes
+                    sendError(ERROR_NUMBER_FORMAT, commandParser.command);
+                    break;
+
+                case ParseResult::FRAME:
+                    isFramedHost = true;
+                    handleFrame(commandParser.frameOpcode(), commandParser.frameSequence(), commandParser.framePayload(), commandParser.frameLength());
+                    break;
+
+                case ParseResult::BAD_CRC:
+                    rejectRequest(0, commandParser.frameSequence(), FRAME_STATUS_BAD_CRC);
+                    break;
+
+                case ParseResult::FRAME_TOO_LONG:
+                    sendError(ERROR_FRAME_TOO_LONG);
+                    break;
+
+                case ParseResult::TIMEOUT:
+                    if(commandParser.command == (char)FRAME_START){
+                        sendError(ERROR_FRAME_TIMEOUT);
+                    } else {
+                        sendError(ERROR_NUMBER_TIMEOUT, commandParser.command);
+                    }
+                    break;
+            }
+        }
+
+
+    // Flow control
+        // Parser side, so it goes straight to Serial like the error lines
+        void sendCredit(){
+            uint8_t frame[] = { FRAME_START, 2, FRAME_CREDIT, 0, (uint8_t)(rxRead & 0xFF), (uint8_t)(rxRead >> 8), 0 };
+            frame[6] = crc8(&frame[1], 5);
+            Serial.write(frame, sizeof(frame));
+            rxReported = rxRead;
+        }
+
+
+    // Running
+        // Sets up the channels and restores their calibration, call from setup() once Serial and the board's storage are up
+        void begin(){
+            loadPatterns();
+            for(uint8_t c = 0; c < CHANNEL_COUNT; c++){
+                channels[c].begin(c, patterns, patternLengths);
+            }
+            sendBanner();
+        }
+
+        // The actuator side of the loop: requests from the parser, then a turn for every channel
+        void update(){
+            #if SHOCKER_METRICS
+                uint32_t start = Board::metricsClock();
+            #endif
+
+            if constexpr (Board::SPLIT_TASKS){
+                Command request;
+                while(Board::nextRequest(request)){
+                    handleRequest(request);
+                    channels[request.channel].processCommandQueue();
+                }
+            }
+            for(Channel &channel : channels){
+                channel.update();
+            }
+
+            #if SHOCKER_METRICS
+                Channel::metrics.loopUs.record((Board::metricsClock() - start) / Board::METRICS_CLOCK_PER_US);
+            #endif
+        }
+
+        // Milliseconds until a channel has something to do, idle_ms if they are all only waiting for commands
+        unsigned long msUntilDue(unsigned long idle_ms){
+            unsigned long due_ms = channels[0].msUntilDue(idle_ms);
+            for(uint8_t c = 1; c < CHANNEL_COUNT; c++){
+                unsigned long channel_ms = channels[c].msUntilDue(idle_ms);
+                due_ms = channel_ms < due_ms ? channel_ms : due_ms;
+            }
+            return due_ms;
+        }
+
+        bool isIdle(){
+            for(Channel &channel : channels){
+                if(!channel.isIdle())
+                    return false;
+            }
+            return true;
+        }
+
+        // The serial side of the loop: feeds every byte that arrived to the parser
+        void readSerial(){
+            handleParseResult(commandParser.poll(millis()));
+
+            #if SHOCKER_METRICS
+                if(Serial.available() >= Board::SERIAL_RX_CAPACITY && rxOverflows != 0xFFFF){
+                    rxOverflows++;
+                }
+            #endif
+            while(Serial.available()){
+                uint8_t c = Serial.read();
+                #if SHOCKER_RECORDER
+                    recorder.add(c, millis());
+                #endif
+                ParseResult result = commandParser.feed(c, millis());
+                #if SHOCKER_METRICS
+                    if(result != ParseResult::NONE){
+                        commandReceivedUs = micros();
+                    }
+                #endif
+                if(result != ParseResult::COMMAND || (c != '\r' && c != '\n')){
+                    rxRead++;
+                }
+                handleParseResult(result);
+                if(isFramedHost && (uint16_t)(rxRead - rxReported) >= CREDIT_REPORT_BYTES){
+                    sendCredit();
+                }
+            }
+            if(isFramedHost && rxRead != rxReported){
+                sendCredit();
+            }
+        }
+};
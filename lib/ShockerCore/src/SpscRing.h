@@ -0,0 +1,47 @@
+// Lock-free ring with one producer and one consumer, each on its own task or core. The producer can stage several
+// items and make them visible to the consumer at once, so a reader never sees half a line or frame.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, uint16_t SIZE> class SpscRing {
+public:
+    // Producer side. Staged items stay invisible to the consumer until publish().
+    bool stage(const T &item){
+        uint16_t next = (staged + 1) % SIZE;
+        if(next == tail.load(std::memory_order_acquire))
+            return false; // Full
+        items[staged] = item;
+        staged = next;
+        return true;
+    }
+    void publish(){
+        head.store(staged, std::memory_order_release);
+    }
+    bool push(const T &item){
+        if(!stage(item))
+            return false;
+        publish();
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T &item){
+        uint16_t index = tail.load(std::memory_order_relaxed);
+        if(index == head.load(std::memory_order_acquire))
+            return false; // Empty
+        item = items[index];
+        tail.store((index + 1) % SIZE, std::memory_order_release);
+        return true;
+    }
+    bool isEmpty() const {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+private:
+    T items[SIZE];
+    uint16_t staged = 0; // Producer only
+    std::atomic<uint16_t> head{0};
+    std::atomic<uint16_t> tail{0};
+};